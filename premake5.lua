@@ -72,4 +72,12 @@ project "L-system 2D"
     files ({source_folder .. "**.h", source_folder .. "**.c", source_folder .. "**.cpp"})
     removefiles{ source_folder .. "main*.cpp"}
     files ({source_folder .. "main_2d.cpp"})
+    
+project "L-system Benchmark"
+    kind "ConsoleApp"
+    targetdir(binaries_folder)
+    targetname("benchmark")
+    files ({source_folder .. "**.h", source_folder .. "**.c", source_folder .. "**.cpp"})
+    removefiles{ source_folder .. "main*.cpp"}
+    files ({source_folder .. "main_benchmark.cpp"})
     
\ No newline at end of file
@@ -0,0 +1,104 @@
+#include "mappedfile.h"
+
+#ifdef OS_WINDOWS
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+	Close();
+}
+
+#ifdef OS_WINDOWS
+bool MappedFile::Open(std::filesystem::path filePath)
+{
+	Close();
+
+	HANDLE file = CreateFileW(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// The view keeps the mapping alive, both handles can be closed right away
+	HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(file);
+	if (mapping == NULL)
+	{
+		return false;
+	}
+
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (view == NULL)
+	{
+		return false;
+	}
+
+	data = (const uint8_t*)view;
+	size = size_t(fileSize.QuadPart);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data)
+	{
+		UnmapViewOfFile(data);
+	}
+	data = nullptr;
+	size = 0;
+}
+#else
+bool MappedFile::Open(std::filesystem::path filePath)
+{
+	Close();
+
+	int file = open(filePath.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+
+	struct stat fileStatus;
+	if (fstat(file, &fileStatus) != 0 || fileStatus.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	void* view = mmap(nullptr, size_t(fileStatus.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);
+	if (view == MAP_FAILED)
+	{
+		return false;
+	}
+
+	data = (const uint8_t*)view;
+	size = size_t(fileStatus.st_size);
+	return true;
+}
+
+void MappedFile::Close()
+{
+	if (data)
+	{
+		munmap((void*)data, size);
+	}
+	data = nullptr;
+	size = 0;
+}
+#endif
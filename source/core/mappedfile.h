@@ -0,0 +1,38 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <filesystem>
+
+// Read-only view of a whole file mapped into memory. Pages are read from disk when they are first touched,
+// so opening a large file is cheap and only the parts that are used get loaded.
+class MappedFile
+{
+protected:
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+
+public:
+	MappedFile() = default;
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool Open(std::filesystem::path filePath);
+	void Close();
+
+	bool IsOpen() const
+	{
+		return data != nullptr;
+	}
+
+	const uint8_t* Data() const
+	{
+		return data;
+	}
+
+	size_t Size() const
+	{
+		return size;
+	}
+};
@@ -8,6 +8,13 @@ UniformRandomGenerator::UniformRandomGenerator()
 	xorseed[1] = (uint64_t(rd()) << 32) ^ (rd());
 }
 
+UniformRandomGenerator::UniformRandomGenerator(uint64_t seed)
+{
+	// MixBits is a bijection, so the two words differ and the state is never all zero (which would only produce zeros)
+	xorseed[0] = MixBits(seed + 0x9E3779B97F4A7C15ull);
+	xorseed[1] = MixBits(seed + 2 * 0x9E3779B97F4A7C15ull);
+}
+
 double UniformRandomGenerator::RandomDouble()
 {
 	return to_double(RandomInt());
@@ -26,4 +33,36 @@ float UniformRandomGenerator::RandomFloat()
 float UniformRandomGenerator::RandomFloat(float min, float max)
 {
 	return min + (max - min) * float(RandomDouble());
-}
\ No newline at end of file
+}
+
+void UniformRandomGenerator::Jump()
+{
+	// x^(2^64) modulo the characteristic polynomial of this xorshift128+ (shifts 23, 17, 26), low coefficients first.
+	// Same method as Vigna's xorshift128plus.c, whose published constants belong to the 23, 18, 5 variant.
+	static const uint64_t jumpPolynomial[] = { 0x8c405782bca686adull, 0xc44f35946fef49c6ull };
+
+	uint64_t s0 = 0;
+	uint64_t s1 = 0;
+	for (uint64_t word : jumpPolynomial)
+	{
+		for (int bit = 0; bit < 64; bit++)
+		{
+			if (word & (uint64_t(1) << bit))
+			{
+				s0 ^= xorseed[0];
+				s1 ^= xorseed[1];
+			}
+			RandomInt();
+		}
+	}
+
+	xorseed[0] = s0;
+	xorseed[1] = s1;
+}
+
+UniformRandomGenerator UniformRandomGenerator::Split()
+{
+	UniformRandomGenerator stream = *this;
+	Jump();
+	return stream;
+}
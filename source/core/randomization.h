@@ -1,5 +1,51 @@
 #pragma once
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+	Counter based hashing (SplitMix64 finalizer)
+	The same inputs always give the same number, so random choices made with it do not depend
+	on evaluation order or on which thread makes them.
+*/
+inline uint64_t MixBits(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ull;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBull;
+	x ^= x >> 31;
+	return x;
+}
+
+inline uint64_t HashCounter(uint64_t seed, uint64_t a, uint64_t b)
+{
+	uint64_t x = MixBits(seed + 0x9E3779B97F4A7C15ull);
+	x = MixBits(x ^ a);
+	return MixBits(x ^ b);
+}
+
+// Hash of a block of memory, e.g. to use file contents or mesh data as part of a cache key
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 0)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	uint64_t hash = MixBits(seed ^ (size * 0x9E3779B97F4A7C15ull));
+	for (size_t i = 0; i < size; i += 8)
+	{
+		uint64_t word = 0;
+		for (size_t j = 0; j < 8 && i + j < size; j++)
+		{
+			word |= uint64_t(bytes[i + j]) << (8 * j);
+		}
+		hash = MixBits(hash ^ word) + 0x9E3779B97F4A7C15ull;
+	}
+	return MixBits(hash);
+}
+
+// Maps 64 random bits to [0, 1)
+inline double UnitDouble(uint64_t x)
+{
+	return double(x >> 11) * (1.0 / 9007199254740992.0);
+}
 
 /*
 	Xorshift
@@ -13,6 +59,7 @@ protected:
 
 public:
 	UniformRandomGenerator();
+	explicit UniformRandomGenerator(uint64_t seed); // the same seed always gives the same sequence
 	~UniformRandomGenerator() = default;
 
 protected:
@@ -27,6 +74,7 @@ protected:
 		return u.d - 1.0;
 	}
 
+public:
 	// xorshift128plus
 	inline uint64_t RandomInt()
 	{
@@ -38,9 +86,47 @@ protected:
 		return xorseed[1] + y;
 	}
 
-public:
 	double RandomDouble();
 	double RandomDouble(double min, double max);
 	float RandomFloat();
 	float RandomFloat(float min, float max);
+
+	// Advances the state by 2^64 draws, so sequences made by repeated jumps never overlap
+	void Jump();
+
+	// Returns a generator that continues this sequence and jumps this one ahead, splitting off a stream
+	// of 2^64 numbers that no later draw from this generator will repeat
+	UniformRandomGenerator Split();
+
+	// Generator for one numbered part of a seeded job (a stage, a branch, a block of modules). Parts can be
+	// made in any order and on any thread, the result only depends on the seed and the numbers.
+	static UniformRandomGenerator Substream(uint64_t seed, uint64_t stream, uint64_t index = 0)
+	{
+		return UniformRandomGenerator{ HashCounter(seed, stream, index) };
+	}
+};
+
+// Uniform random value in [min, max]
+struct RandomRange
+{
+	float min = 0.0f;
+	float max = 0.0f;
+
+	bool IsRandom() const
+	{
+		return min != max;
+	}
+
+	// Always takes a number from the generator, also when min == max. The species ranges use this, so every module
+	// consumes the same random numbers and changing one range does not shift the draws of the others.
+	float Draw(UniformRandomGenerator& generator) const
+	{
+		return generator.RandomFloat(min, max);
+	}
+
+	// Only takes a number from the generator when the range is random, like the instructions of a grammar file
+	float DrawIfRandom(UniformRandomGenerator& generator) const
+	{
+		return IsRandom() ? generator.RandomFloat(min, max) : min;
+	}
 };
\ No newline at end of file
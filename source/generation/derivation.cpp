@@ -0,0 +1,128 @@
+#include "derivation.h"
+
+DerivationGraph::DerivationGraph(const LSystemString& lsystem, int maxIterations)
+	: axiom{ lsystem.axiom }, maxIterations{ (maxIterations < 0) ? 0 : maxIterations }
+{
+	Build(lsystem.Compile());
+}
+
+DerivationGraph::DerivationGraph(const CompiledLSystem& lsystem, int maxIterations)
+	: axiom{ lsystem.axiom }, maxIterations{ (maxIterations < 0) ? 0 : maxIterations }
+{
+	Build(lsystem);
+}
+
+void DerivationGraph::Build(const CompiledLSystem& lsystem)
+{
+	nodes.clear();
+	children.clear();
+	nodeIds.resize(size_t(maxIterations) + 1);
+	for (auto& ids : nodeIds)
+	{
+		ids.fill(None);
+	}
+
+	// Every symbol gets one final node that is shared by all depths where it is not rewritten.
+	// They take the ids 0-255, StreamProduction relies on that to skip the node lookup.
+	std::array<uint32_t, 256>& finalNodes = nodeIds[0];
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		Node node;
+		node.symbol = char(symbol);
+		finalNodes[symbol] = uint32_t(nodes.size());
+		nodes.push_back(node);
+	}
+
+	for (int k = 1; k <= maxIterations; k++)
+	{
+		const std::array<uint32_t, 256>& previous = nodeIds[k - 1];
+		std::array<uint32_t, 256>& current = nodeIds[k];
+
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			const CompiledLSystem::Successor& successor = lsystem.successors[symbol];
+			if (!successor.isVariable)
+			{
+				current[symbol] = finalNodes[symbol];
+				continue;
+			}
+
+			const CompiledLSystem::Alternative& alternative = lsystem.alternatives[successor.firstAlternative];
+			const char* symbols = lsystem.SuccessorSymbols(alternative);
+
+			Node node;
+			node.symbol = char(symbol);
+			node.firstChild = uint32_t(children.size());
+			node.childCount = alternative.length;
+			node.length = 0;
+			node.isFlat = true;
+			for (uint32_t i = 0; i < alternative.length; i++)
+			{
+				uint32_t child = previous[(unsigned char)symbols[i]];
+				node.isFlat = node.isFlat && (child < 256);
+				uint64_t childLength = nodes[child].length;
+				node.length = (node.length > UINT64_MAX - childLength) ? UINT64_MAX : node.length + childLength;
+				children.push_back(child);
+			}
+
+			current[symbol] = uint32_t(nodes.size());
+			nodes.push_back(node);
+		}
+	}
+}
+
+uint64_t DerivationGraph::ProductionLength(int iterations) const
+{
+	iterations = (iterations < 0) ? 0 : (iterations > maxIterations) ? maxIterations : iterations;
+
+	uint64_t length = 0;
+	for (char c : axiom)
+	{
+		uint64_t symbolLength = nodes[FindNode(c, iterations)].length;
+		length = (length > UINT64_MAX - symbolLength) ? UINT64_MAX : length + symbolLength;
+	}
+	return length;
+}
+
+int DerivationGraph::MaxBracketDepth(int iterations) const
+{
+	iterations = (iterations < 0) ? 0 : (iterations > maxIterations) ? maxIterations : iterations;
+
+	// Children are always added before the nodes that reference them
+	std::vector<BracketProfile> profiles(nodes.size());
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		const Node& node = nodes[i];
+		if (i < 256)
+		{
+			profiles[i] = BracketProfile::Of(node.symbol);
+			continue;
+		}
+
+		for (uint32_t c = 0; c < node.childCount; c++)
+		{
+			profiles[i].Append(profiles[children[node.firstChild + c]]);
+		}
+	}
+
+	BracketProfile production;
+	for (char c : axiom)
+	{
+		production.Append(profiles[FindNode(c, iterations)]);
+	}
+	return (production.peak > INT32_MAX) ? INT32_MAX : int(production.peak);
+}
+
+std::string DerivationGraph::RunProduction(int iterations) const
+{
+	std::string production;
+	production.resize(size_t(ProductionLength(iterations)));
+
+	char* output = &production[0];
+	StreamProduction(iterations, [&output](char c)
+	{
+		*output++ = c;
+	});
+
+	return production;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include "lsystem.h"
+
+// Hash-consed derivation tree of a deterministic L-system. With deterministic rules a symbol expanded for
+// k more iterations always produces the same substring, so every (symbol, remaining iterations) pair is
+// stored once as a node that references the nodes of its successor. Identical subtrees are shared and the
+// size of the graph grows with iterations * symbols instead of with the length of the production.
+class DerivationGraph
+{
+public:
+	static constexpr uint32_t None = UINT32_MAX;
+
+	struct Node
+	{
+		uint32_t firstChild = 0;	// index into children
+		uint32_t childCount = 0;	// 0 for final symbols (ids 0-255) and for variables with an empty successor
+		char symbol = 0;
+		bool isFlat = false;		// every child is a final symbol
+		uint64_t length = 1;		// number of final symbols below the node (saturates at UINT64_MAX)
+	};
+
+	std::string axiom = "";
+	int maxIterations = 0;
+	std::vector<Node> nodes;
+	std::vector<uint32_t> children;
+	std::vector<std::array<uint32_t, 256>> nodeIds; // node of every symbol, indexed as nodeIds[remaining iterations][unsigned char]
+
+	DerivationGraph() = default;
+	DerivationGraph(const LSystemString& lsystem, int maxIterations);
+	DerivationGraph(const CompiledLSystem& lsystem, int maxIterations); // uses the first alternative of stochastic rules
+	~DerivationGraph() = default;
+
+	uint32_t FindNode(char symbol, int iterations) const
+	{
+		return nodeIds[iterations][(unsigned char)symbol];
+	}
+
+	uint64_t ProductionLength(int iterations) const;
+	std::string RunProduction(int iterations) const;
+	int MaxBracketDepth(int iterations) const; // deepest '[' nesting, see CompiledLSystem::MaxBracketDepth
+
+	// Walks the graph depth-first and hands each final symbol to onSymbol, the same order as LSystemString::StreamProduction.
+	// Any iteration count up to maxIterations can be walked, so the graph plugs into Turtle3D::GenerateSkeleton
+	// and Turtle2D::Draw like any other L-system.
+	template<class SymbolCallback>
+	void StreamProduction(int iterations, SymbolCallback&& onSymbol) const
+	{
+		struct Cursor
+		{
+			const uint32_t* next;
+			const uint32_t* end;
+		};
+
+		iterations = (iterations < 0) ? 0 : (iterations > maxIterations) ? maxIterations : iterations;
+
+		std::vector<Cursor> stack;
+		stack.reserve(size_t(iterations) + 1);
+		for (char c : axiom)
+		{
+			uint32_t rootId = FindNode(c, iterations);
+			if (rootId < 256)
+			{
+				onSymbol(char(rootId));
+				continue;
+			}
+
+			const Node& root = nodes[rootId];
+
+			const uint32_t* first = children.data() + root.firstChild;
+			stack.push_back(Cursor{ first, first + root.childCount });
+			while (!stack.empty())
+			{
+				Cursor& top = stack.back();
+				if (top.next == top.end)
+				{
+					stack.pop_back();
+					continue;
+				}
+
+				uint32_t child = *top.next++;
+				if (child < 256)
+				{
+					// Final nodes are created first, so their id is the symbol itself
+					onSymbol(char(child));
+				}
+				else
+				{
+					const Node& node = nodes[child];
+					first = children.data() + node.firstChild;
+					if (node.isFlat)
+					{
+						for (const uint32_t* flat = first; flat != first + node.childCount; flat++)
+						{
+							onSymbol(char(*flat));
+						}
+					}
+					else
+					{
+						stack.push_back(Cursor{ first, first + node.childCount });
+					}
+				}
+			}
+		}
+	}
+
+protected:
+	void Build(const CompiledLSystem& lsystem);
+};
@@ -1,34 +1,145 @@
 #include "fractals.h"
 #include "../thirdparty/glmGeom.h"
+#include <cstring>
 
 using BasicTurtle2D = Turtle2D<>;
 
-void DrawFractalTree(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
+/*
+	Grammars
+*/
+LSystemString FractalTreeGrammar()
 {
 	LSystemString fractalTree;
 	fractalTree.axiom = "0";
 	fractalTree.productionRules['0'] = "1[0]0";
 	fractalTree.productionRules['1'] = "11";
 
+	return fractalTree;
+}
+
+LSystemString KochCurveGrammar()
+{
+	LSystemString kochCurve;
+	kochCurve.axiom = "F";
+	kochCurve.productionRules['F'] = "F+F-F-F+F";
+
+	return kochCurve;
+}
+
+LSystemString SierpinskiTriangleGrammar()
+{
+	LSystemString sierpinskiTriangle;
+	sierpinskiTriangle.axiom = "F-G-G";
+	sierpinskiTriangle.productionRules['F'] = "F-G+F+G-F";
+	sierpinskiTriangle.productionRules['G'] = "GG";
+
+	return sierpinskiTriangle;
+}
+
+LSystemString DragonCurveGrammar()
+{
+	LSystemString dragonCurve;
+	dragonCurve.axiom = "FX";
+	dragonCurve.productionRules['X'] = "X+YF+";
+	dragonCurve.productionRules['Y'] = "-FX-Y";
+
+	return dragonCurve;
+}
+
+LSystemString FractalPlantGrammar()
+{
+	LSystemString fractalPlant;
+	fractalPlant.axiom = "X";
+	fractalPlant.productionRules['X'] = "F+[[X]-X]-F[-FX]+X";
+	fractalPlant.productionRules['F'] = "FF";
+
+	return fractalPlant;
+}
+
+LSystemString FractalTreeNezumiV1Grammar()
+{
+	// https://lazynezumi.com/lsystems
+	LSystemString fractalTreeNezumi;
+	fractalTreeNezumi.axiom = "[B]";
+	fractalTreeNezumi.productionRules['B'] = "A[-B][+B]";
+
+	return fractalTreeNezumi;
+}
+
+LSystemString FractalTreeNezumiV2Grammar()
+{
+	// https://lazynezumi.com/lsystems
+	LSystemString fractalTreeNezumi;
+	fractalTreeNezumi.axiom = "[B]";
+	fractalTreeNezumi.productionRules['B'] = "A[!%-B][!%+B]!%AB";
+
+	return fractalTreeNezumi;
+}
+
+LSystemString FractalLeafGrammar()
+{
+	LSystemString fractalLeaf;
+	fractalLeaf.axiom = "0";
+	fractalLeaf.productionRules['0'] = "1[-0][+0]1e";
+	fractalLeaf.productionRules['1'] = "11";
+	fractalLeaf.productionRules['e'] = fractalLeaf.productionRules['0'];
+
+	return fractalLeaf;
+}
+
+LSystemContextSensitive SignalPropagationGrammar()
+{
+	// The Algorithmic Beauty of Plants, figure 1.31a. Signals (1) travel along the branches and
+	// a new branch or segment appears where they meet a 0. Context skips rotations and segments.
+	LSystemContextSensitive signalPlant;
+	signalPlant.axiom = "F1F1F1";
+	signalPlant.ignoredSymbols = "+-F";
+	signalPlant.productionRules['0'] = {
+		{ "0", "0", "0" },
+		{ "0", "1", "1[+F1F1]" },
+		{ "1", "0", "0" },
+		{ "1", "1", "1F1" }
+	};
+	signalPlant.productionRules['1'] = {
+		{ "0", "0", "1" },
+		{ "0", "1", "1" },
+		{ "1", "0", "0" },
+		{ "1", "1", "0" }
+	};
+	signalPlant.productionRules['+'] = { { "", "", "-" } };
+	signalPlant.productionRules['-'] = { { "", "", "+" } };
+
+	return signalPlant;
+}
+
+
+/*
+	2D drawing
+*/
+void DrawFractalTree(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
+{
+	LSystemString fractalTree = FractalTreeGrammar();
+
 	BasicTurtle2D turtle;
-	turtle.actions['0'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['0'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
 	turtle.actions['1'] = turtle.actions['0'];
-	turtle.actions['['] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['['] = [scale](BasicTurtle2D& t) {
 		t.PushState();
 		t.Rotate(45.0f);
 	};
-	turtle.actions[']'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions[']'] = [scale](BasicTurtle2D& t) {
 		t.PopState();
 		t.Rotate(-45.0f);
 	};
 
 	turtle.Draw(
 		canvas, 
-		fractalTree.RunProduction(iterations),
+		fractalTree,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -36,22 +147,21 @@ void DrawFractalTree(Canvas2D& canvas, int iterations, float scale, glm::fvec2 o
 
 void DrawKochCurve(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	LSystemString kochCurve;
-	kochCurve.axiom = "F";
-	kochCurve.productionRules['F'] = "F+F-F-F+F";
+	LSystemString kochCurve = KochCurveGrammar();
 
 	BasicTurtle2D turtle;
-	turtle.actions['F'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['F'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(90.0f); };
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-90.0f); };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(90.0f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(-90.0f); };
 
 	turtle.Draw(
 		canvas,
-		kochCurve.RunProduction(iterations),
+		kochCurve,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -59,24 +169,22 @@ void DrawKochCurve(Canvas2D& canvas, int iterations, float scale, glm::fvec2 ori
 
 void DrawSierpinskiTriangle(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	LSystemString sierpinskiTriangle;
-	sierpinskiTriangle.axiom = "F-G-G";
-	sierpinskiTriangle.productionRules['F'] = "F-G+F+G-F";
-	sierpinskiTriangle.productionRules['G'] = "GG";
+	LSystemString sierpinskiTriangle = SierpinskiTriangleGrammar();
 
 	BasicTurtle2D turtle;
-	turtle.actions['F'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['F'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
 	turtle.actions['G'] = turtle.actions['F'];
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(120.0f); };
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-120.0f); };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(120.0f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(-120.0f); };
 
 	turtle.Draw(
 		canvas,
-		sierpinskiTriangle.RunProduction(iterations),
+		sierpinskiTriangle,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -84,23 +192,21 @@ void DrawSierpinskiTriangle(Canvas2D& canvas, int iterations, float scale, glm::
 
 void DrawDragonCurve(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	LSystemString dragonCurve;
-	dragonCurve.axiom = "FX";
-	dragonCurve.productionRules['X'] = "X+YF+";
-	dragonCurve.productionRules['Y'] = "-FX-Y";
+	LSystemString dragonCurve = DragonCurveGrammar();
 
 	BasicTurtle2D turtle;
-	turtle.actions['F'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['F'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-90.0f); };
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(90.0f); };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(-90.0f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(90.0f); };
 
 	turtle.Draw(
 		canvas,
-		dragonCurve.RunProduction(iterations),
+		dragonCurve,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -108,52 +214,71 @@ void DrawDragonCurve(Canvas2D& canvas, int iterations, float scale, glm::fvec2 o
 
 void DrawFractalPlant(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	LSystemString fractalPlant;
-	fractalPlant.axiom = "X";
-	fractalPlant.productionRules['X'] = "F+[[X]-X]-F[-FX]+X";
-	fractalPlant.productionRules['F'] = "FF";
+	LSystemString fractalPlant = FractalPlantGrammar();
 
 	BasicTurtle2D turtle;
-	turtle.actions['F'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['F'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-25.0f); };
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(25.0f); };
-	turtle.actions['['] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PushState(); };
-	turtle.actions[']'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PopState(); };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(-25.0f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(25.0f); };
+	turtle.actions['['] = [scale](BasicTurtle2D& t) { t.PushState(); };
+	turtle.actions[']'] = [scale](BasicTurtle2D& t) { t.PopState(); };
 
 	turtle.Draw(
 		canvas,
-		fractalPlant.RunProduction(iterations),
+		fractalPlant,
+		iterations,
 		origin,
 		startAngle
 	);
 }
 
-void DrawFractalTreeNezumiV1(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
+void DrawSignalPropagationPlant(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	// https://lazynezumi.com/lsystems
+	LSystemContextSensitive signalPlant = SignalPropagationGrammar();
 
-	LSystemString fractalTreeNezumi;
-	fractalTreeNezumi.axiom = "[B]";
-	fractalTreeNezumi.productionRules['B'] = "A[-B][+B]";
+	BasicTurtle2D turtle;
+	turtle.actions['F'] = [scale](BasicTurtle2D& t) {
+		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.state.position = newPosition;
+	};
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(-22.5f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(22.5f); };
+	turtle.actions['['] = [scale](BasicTurtle2D& t) { t.PushState(); };
+	turtle.actions[']'] = [scale](BasicTurtle2D& t) { t.PopState(); };
+
+	std::string symbols = signalPlant.RunProduction(iterations);
+	turtle.Draw(
+		canvas,
+		symbols,
+		origin,
+		startAngle
+	);
+}
+
+void DrawFractalTreeNezumiV1(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
+{
+	LSystemString fractalTreeNezumi = FractalTreeNezumiV1Grammar();
 
 	BasicTurtle2D turtle;
-	turtle.actions['A'] = [scale](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['A'] = [scale](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-20.0f); };
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(20.0f); };
-	turtle.actions['['] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PushState(); };
-	turtle.actions[']'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PopState(); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(-20.0f); };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(20.0f); };
+	turtle.actions['['] = [scale](BasicTurtle2D& t) { t.PushState(); };
+	turtle.actions[']'] = [scale](BasicTurtle2D& t) { t.PopState(); };
 
 	turtle.Draw(
 		canvas,
-		fractalTreeNezumi.RunProduction(iterations),
+		fractalTreeNezumi,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -161,11 +286,7 @@ void DrawFractalTreeNezumiV1(Canvas2D& canvas, int iterations, float scale, glm:
 
 void DrawFractalTreeNezumiV2(Canvas2D& canvas, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	// https://lazynezumi.com/lsystems
-
-	LSystemString fractalTreeNezumi;
-	fractalTreeNezumi.axiom = "[B]";
-	fractalTreeNezumi.productionRules['B'] = "A[!%-B][!%+B]!%AB";
+	LSystemString fractalTreeNezumi = FractalTreeNezumiV2Grammar();
 
 	struct NezumiProps
 	{
@@ -174,26 +295,27 @@ void DrawFractalTreeNezumiV2(Canvas2D& canvas, int iterations, float scale, glm:
 	using NezumiTurtle = Turtle2D<NezumiProps>;
 
 	NezumiTurtle turtle;
-	turtle.actions['A'] = [scale](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['A'] = [scale](NezumiTurtle& t)
 	{
 		NezumiProps& p = t.state.properties;
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale * p.lengthFactor;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['%'] = [](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['%'] = [](NezumiTurtle& t)
 	{
 		NezumiProps& p = t.state.properties;
 		p.lengthFactor /= 1.3f;
 	};
-	turtle.actions['-'] = [](NezumiTurtle& t, Canvas2D& c) { t.Rotate(-20.0f); };
-	turtle.actions['+'] = [](NezumiTurtle& t, Canvas2D& c) { t.Rotate(20.0f); };
-	turtle.actions['['] = [](NezumiTurtle& t, Canvas2D& c) { t.PushState(); };
-	turtle.actions[']'] = [](NezumiTurtle& t, Canvas2D& c) { t.PopState(); };
+	turtle.actions['-'] = [](NezumiTurtle& t) { t.Rotate(-20.0f); };
+	turtle.actions['+'] = [](NezumiTurtle& t) { t.Rotate(20.0f); };
+	turtle.actions['['] = [](NezumiTurtle& t) { t.PushState(); };
+	turtle.actions[']'] = [](NezumiTurtle& t) { t.PopState(); };
 
 	turtle.Draw(
 		canvas,
-		fractalTreeNezumi.RunProduction(iterations),
+		fractalTreeNezumi,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -204,9 +326,7 @@ void DrawFractalTreeNezumiV3(Canvas2D& canvas, int iterations, float scale, glm:
 	// https://lazynezumi.com/lsystems
 
 	UniformRandomGenerator uniformGenerator;
-	LSystemString fractalTreeNezumi;
-	fractalTreeNezumi.axiom = "[B]";
-	fractalTreeNezumi.productionRules['B'] = "A[!%-B][!%+B]!%AB";
+	LSystemString fractalTreeNezumi = FractalTreeNezumiV2Grammar();
 
 	bool skipBranch = false;
 
@@ -217,41 +337,41 @@ void DrawFractalTreeNezumiV3(Canvas2D& canvas, int iterations, float scale, glm:
 	using NezumiTurtle = Turtle2D<NezumiProps>;
 	NezumiTurtle turtle;
 
-	turtle.actions['A'] = [scale, &skipBranch, &uniformGenerator](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['A'] = [scale, &skipBranch, &uniformGenerator](NezumiTurtle& t)
 	{
 		if (skipBranch) return;
 
 		NezumiProps& p = t.state.properties;
 		float randomLengthFactor = 1.0f + uniformGenerator.RandomFloat(0.0f, 0.15f);
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale * p.lengthFactor * randomLengthFactor;
-		c.DrawLine(t.state.position, newPosition, Color{ 0,0,0,255 });
+		t.AddSegment(t.state.position, newPosition, Color{ 0,0,0,255 });
 		t.state.position = newPosition;
 	};
-	turtle.actions['%'] = [&skipBranch](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['%'] = [&skipBranch](NezumiTurtle& t)
 	{
 		if (skipBranch) return;
 
 		NezumiProps& p = t.state.properties;
 		p.lengthFactor /= 1.6f;
 	};
-	turtle.actions['-'] = [&skipBranch, &uniformGenerator](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['-'] = [&skipBranch, &uniformGenerator](NezumiTurtle& t)
 	{ 
 		if (skipBranch) return;
 
 		t.Rotate(-20.0f + uniformGenerator.RandomFloat(-5.0f, 5.0f));
 	};
-	turtle.actions['+'] = [&skipBranch, &uniformGenerator](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['+'] = [&skipBranch, &uniformGenerator](NezumiTurtle& t)
 	{ 
 		if (skipBranch) return;
 
 		t.Rotate(20.0f + uniformGenerator.RandomFloat(-5.0f, 5.0f)); 
 	};
-	turtle.actions['['] = [&skipBranch, &uniformGenerator](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions['['] = [&skipBranch, &uniformGenerator](NezumiTurtle& t)
 	{ 
 		skipBranch = uniformGenerator.RandomFloat() > 0.8;
 		t.PushState(); 
 	};
-	turtle.actions[']'] = [&skipBranch](NezumiTurtle& t, Canvas2D& c)
+	turtle.actions[']'] = [&skipBranch](NezumiTurtle& t)
 	{ 
 		t.PopState(); 
 		skipBranch = false;
@@ -259,7 +379,8 @@ void DrawFractalTreeNezumiV3(Canvas2D& canvas, int iterations, float scale, glm:
 
 	turtle.Draw(
 		canvas,
-		fractalTreeNezumi.RunProduction(iterations),
+		fractalTreeNezumi,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -267,32 +388,29 @@ void DrawFractalTreeNezumiV3(Canvas2D& canvas, int iterations, float scale, glm:
 
 void DrawFractalLeaf(std::vector<glm::fvec3>& generatedHull, Canvas2D& canvas, Color color, int iterations, float scale, glm::fvec2 origin, float startAngle)
 {
-	LSystemString fractalLeaf;
-	fractalLeaf.axiom = "0";
-	fractalLeaf.productionRules['0'] = "1[-0][+0]1e";
-	fractalLeaf.productionRules['1'] = "11";
-	fractalLeaf.productionRules['e'] = fractalLeaf.productionRules['0'];
+	LSystemString fractalLeaf = FractalLeafGrammar();
 
 	BasicTurtle2D turtle;
 	std::vector<glm::fvec3> leafPositions{ glm::fvec3{origin, 1.0f} };
-	turtle.actions['0'] = [scale, &color](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['0'] = [scale, &color](BasicTurtle2D& t) {
 		glm::fvec2 newPosition = t.state.position + t.GetDirection() * scale;
-		c.DrawLine(t.state.position, newPosition, color);
+		t.AddSegment(t.state.position, newPosition, color);
 		t.state.position = newPosition;
 	};
 	turtle.actions['1'] = turtle.actions['0'];
-	turtle.actions['e'] = [scale, &leafPositions](BasicTurtle2D& t, Canvas2D& c) {
+	turtle.actions['e'] = [scale, &leafPositions](BasicTurtle2D& t) {
 		leafPositions.push_back(glm::fvec3(t.state.position, 0.0f));
 	};
 
-	turtle.actions['['] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PushState(); };
-	turtle.actions[']'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.PopState();  };
-	turtle.actions['+'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(45.0f); };
-	turtle.actions['-'] = [scale](BasicTurtle2D& t, Canvas2D& c) { t.Rotate(-45.0f); };
+	turtle.actions['['] = [scale](BasicTurtle2D& t) { t.PushState(); };
+	turtle.actions[']'] = [scale](BasicTurtle2D& t) { t.PopState();  };
+	turtle.actions['+'] = [scale](BasicTurtle2D& t) { t.Rotate(45.0f); };
+	turtle.actions['-'] = [scale](BasicTurtle2D& t) { t.Rotate(-45.0f); };
 
 	turtle.Draw(
 		canvas,
-		fractalLeaf.RunProduction(iterations),
+		fractalLeaf,
+		iterations,
 		origin,
 		startAngle
 	);
@@ -307,166 +425,224 @@ void DrawFractalLeaf(std::vector<glm::fvec3>& generatedHull, Canvas2D& canvas, C
 
 
 
-void BuildBranchesForFractalTree3D(std::vector<FractalBranch>& branches, Bone<FractalTree3DProps>* bone)
+/*
+	3D tree species
+*/
+SpeciesDescriptor SpeciesDescriptor::WithoutRandomness() const
 {
-	/*
-		A lastChild is considered a continuation of the same branch for the FractalTree3D. 
-		If there is more than one child in a node, it means there is a new branch. 
-		This method traverses the nodes and builds branches for each lastChild chain.
-	*/
-	using TBone = Bone<FractalTree3DProps>;
-	using BoneVector = std::vector<TBone*>;
-
-	branches.clear();
-	branches.shrink_to_fit();
-	branches.push_back(FractalBranch{ bone, 1 });
-
-	int activeIndex = 0;
-	while (activeIndex < branches.size())
-	{
-		TBone* firstBone = branches[activeIndex].nodes[0];
+	SpeciesDescriptor species = *this;
+	species.lengthVariation = RandomRange{ 1.0f, 1.0f };
+	species.growRoll = RandomRange{};
+	species.growPitch = RandomRange{};
+	species.branchRollVariation = RandomRange{};
+	species.branchPitchVariation = RandomRange{};
+	return species;
+}
 
-		// Build branch from chain of lastChild's
-		BoneVector potentialBranchingPoints{};
-		TBone* lastChild = firstBone->lastChild;
-		while (lastChild)
-		{
-			branches[activeIndex].Push(lastChild);
-			potentialBranchingPoints.push_back(lastChild);
-			lastChild = lastChild->lastChild;
-		}
+uint64_t SpeciesDescriptor::Hash() const
+{
+	static_assert(sizeof(SpeciesDescriptor) % sizeof(float) == 0, "SpeciesDescriptor must only hold 4 byte fields");
+	return HashBytes(this, sizeof(SpeciesDescriptor));
+}
 
-		// For each previous lastChild, check if there are siblings.
-		// Whenever there is a sibling, it is a new branch.
-		for (TBone* p : potentialBranchingPoints)
-		{
-			TBone* sibling = p->previousSibling;
-			while (sibling)
-			{
-				branches.push_back(FractalBranch{ sibling, branches[activeIndex].depth + 1});
-				sibling = sibling->previousSibling;
-			}
-		}
+SpeciesDescriptor FractalTree3DSpecies(TreeStyle style)
+{
+	SpeciesDescriptor species;
+	species.trunkSegments = (style == TreeStyle::Slim) ? 2 : 1;
 
-		activeIndex++;
-	}
+	return species;
 }
 
-void GenerateFractalTree3DBasic(TreeStyle style, UniformRandomGenerator& uniformGenerator, int iterations, int subdivisions, std::function<void(Bone<FractalTree3DProps>*, std::vector<FractalBranch>&)> onResultCallback)
+LSystemString FractalTree3DGrammar(const SpeciesDescriptor& species)
 {
-	iterations *= 2;
-
 	// https://lazynezumi.com/lsystems
 	LSystemString fractalTree;
 	fractalTree.axiom = "B";
 	fractalTree.productionRules['B'] = "AAC";
-	fractalTree.productionRules['C'] = (style == TreeStyle::Slim) ? "AA[%+B][%++B][%+++B]%B" : "A[%+B][%++B][%+++B]%B";
-
-	using Turtle = Turtle3D<FractalTree3DProps>;
-	Turtle turtle;
 
-	subdivisions = (subdivisions == 0) ? 1 : subdivisions;
-	float subDivFactor = 1.0f / float(subdivisions);
-	turtle.actions['A'] = [&uniformGenerator, subdivisions, subDivFactor](Turtle& t, int repetitions)
+	std::string branching(size_t(species.trunkSegments), 'A');
+	for (int i = 1; i <= species.sideBranches; i++)
 	{
-		float drawLength = subDivFactor * repetitions * t.transform.properties.lengthFactor;
+		branching += "[%" + std::string(size_t(i), '+') + "B]";
+	}
+	fractalTree.productionRules['C'] = branching + "%B";
 
-		for (int d = 0; d < subdivisions; d++)
+	return fractalTree;
+}
+
+ParametricLSystem FractalTree3DParametricGrammar(const SpeciesDescriptor& species)
+{
+	// Same tree as FractalTree3DGrammar. Runs of A become A(count, scale), runs of + become +(count)
+	// and the lengthFactor that % used to shrink is the scale parameter carried by B, C and A.
+	float trunkCount = float(species.trunkSegments);
+	int sideBranches = species.sideBranches;
+	float branchScale = species.branchScale;
+
+	ParametricLSystem fractalTree;
+	fractalTree.axiom.Add('B', { FractalTree3DProps{}.lengthFactor });
+	fractalTree.additiveSymbols = "A";
+	fractalTree.productionRules['B'] = [](const float* p, int count, ModuleStream& successor)
+	{
+		successor.Add('A', { 2.0f, p[0] });
+		successor.Add('C', { 1.0f, p[0] });
+	};
+	fractalTree.productionRules['C'] = [trunkCount, sideBranches, branchScale](const float* p, int count, ModuleStream& successor)
+	{
+		float scale = p[1];
+		successor.Add('A', { trunkCount, scale });
+		for (int i = 1; i <= sideBranches; i++)
 		{
-			t.MoveForward(drawLength);
+			successor.Add('[');
+			successor.Add('+', { float(i) });
+			successor.Add('B', { scale * branchScale });
+			successor.Add(']');
 		}
+		successor.Add('B', { scale * branchScale });
 	};
-	turtle.actions['C'] = turtle.actions['A'];
-	turtle.actions['%'] = [](Turtle& t, int repetitions) { t.transform.properties.lengthFactor *= 0.87f; };
-	turtle.actions['['] = [](Turtle& t, int repetitions) { t.PushState(); };
-	turtle.actions[']'] = [](Turtle& t, int repetitions) { t.PopState(); };
 
-	turtle.actions['+'] = [&uniformGenerator, &iterations](Turtle& t, int repetitions)
+	return fractalTree;
+}
+
+/*
+	FractalTree3DGrammarCache
+*/
+ModuleStream FractalTree3DGrammarCache::RunProduction(const SpeciesDescriptor& species, int iterations, int& maxBracketDepth)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	// Species that only differ outside the grammar share one
+	uint32_t branchScaleBits = 0;
+	std::memcpy(&branchScaleBits, &species.branchScale, sizeof(branchScaleBits));
+	GrammarKey key{ species.trunkSegments, species.sideBranches, branchScaleBits };
+
+	auto grammar = grammars.find(key);
+	if (grammar == grammars.end())
 	{
-		float depth = float(t.activeBone->nodeDepth);
-		float rollBranchOffset = 45.0f*depth;
-
-		t.Rotate(
-			120.0f * repetitions + rollBranchOffset,
-			25.0f
-		);
-
-		// Weigh down the branch based on iterations and length from root
-		glm::fvec3 rotVec = glm::cross(glm::fvec3{ 0.0f, 1.0f, 0.0f }, t.transform.forward);
-		float degrees = 3.0f * iterations / depth;
-		t.Rotate(degrees, rotVec);
-	};
+		if (grammars.size() >= MaxGrammars)
+		{
+			auto leastRecent = grammars.begin();
+			for (auto it = grammars.begin(); it != grammars.end(); it++)
+			{
+				leastRecent = (it->second.lastUse < leastRecent->second.lastUse) ? it : leastRecent;
+			}
+			grammars.erase(leastRecent);
+		}
+		grammar = grammars.emplace(key, CachedGrammar{ FractalTree3DParametricGrammar(species) }).first;
+	}
+	grammar->second.lastUse = ++useCount;
 
-	std::vector<FractalBranch> branches;
-	turtle.GenerateSkeleton(fractalTree.RunProduction(iterations));
-	BuildBranchesForFractalTree3D(branches, turtle.rootBone);
-	onResultCallback(turtle.rootBone, branches);
+	ParametricLSystem& fractalTree = grammar->second.lsystem;
+	ModuleStream production = fractalTree.RunProduction(iterations);
+	maxBracketDepth = fractalTree.MaxBracketDepth(iterations);
+	fractalTree.TrimCache(iterations);
+	return production;
 }
 
-void GenerateFractalTree3DStochastic(TreeStyle style, UniformRandomGenerator& uniformGenerator, int iterations, int subdivisions, std::function<void(Bone<FractalTree3DProps>*, std::vector<FractalBranch>&)> onResultCallback)
+size_t FractalTree3DGrammarCache::MemoryBytes() const
 {
-	iterations *= 2;
+	std::lock_guard<std::mutex> lock(mutex);
 
-	// https://lazynezumi.com/lsystems
-	LSystemString fractalTree;
-	fractalTree.axiom = "B";
-	fractalTree.productionRules['B'] = "AAC";
-	fractalTree.productionRules['C'] = (style == TreeStyle::Slim) ? "AA[%+B][%++B][%+++B]%B" : "A[%+B][%++B][%+++B]%B";
+	size_t bytes = 0;
+	for (const auto& grammar : grammars)
+	{
+		bytes += grammar.second.lsystem.CacheBytes();
+	}
+	return bytes;
+}
 
-	using Turtle = Turtle3D<FractalTree3DProps>;
-	Turtle turtle;
+void FractalTree3DGrammarCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	grammars.clear();
+}
 
-	subdivisions = (subdivisions == 0) ? 1 : subdivisions;
-	float subDivFactor = 1.0f / float(subdivisions);
-	turtle.actions['A'] = [&uniformGenerator, subdivisions, subDivFactor](Turtle& t, int repetitions)
-	{
-		float randomLengthFactor = uniformGenerator.RandomFloat(1.0f, 1.5f);
-		float drawLength = subDivFactor * repetitions * randomLengthFactor * t.transform.properties.lengthFactor;
-		float roll		 = subDivFactor * uniformGenerator.RandomFloat(0.0f, 45.0f);
-		float pitch		 = subDivFactor * uniformGenerator.RandomFloat(-15.0f, 15.0f);
+void BuildBranchesForFractalTree3D(BranchTable& branches, const BonePool<FractalTree3DProps>& bones)
+{
+	/*
+		A lastChild is considered a continuation of the same branch for the FractalTree3D. 
+		If there is more than one child in a node, it means there is a new branch. 
+		The pool is in pre-order, so one pass assigns every bone to its branch (a parent's branch is always known
+		before its children) and a second pass scatters the bone indices into the rows.
+	*/
+	using TBone = Bone<FractalTree3DProps>;
+
+	branches.Clear();
+	size_t size = bones.Size();
+	if (size == 0) return;
 
-		for (int d=0; d<subdivisions; d++)
+	std::vector<uint32_t> branchOfBone(size);
+	std::vector<uint32_t>& counts = branches.offsets; // counts in offsets[b + 1], turned into offsets below
+	for (uint32_t i = 0; i < uint32_t(size); i++)
+	{
+		uint32_t parent = bones[i].parent;
+		if (parent != TBone::None && bones[parent].lastChild == i)
 		{
-			t.Rotate(roll, pitch);
-			t.MoveForward(drawLength);
+			branchOfBone[i] = branchOfBone[parent];
 		}
-	};
-	turtle.actions['C'] = turtle.actions['A'];
-	turtle.actions['%'] = [](Turtle& t, int repetitions) { t.transform.properties.lengthFactor *= 0.87f; };
-	turtle.actions['['] = [](Turtle& t, int repetitions) { t.PushState(); };
-	turtle.actions[']'] = [](Turtle& t, int repetitions) { t.PopState(); };
+		else
+		{
+			uint32_t parentBranch = (parent != TBone::None) ? branchOfBone[parent] : BranchTable::None;
+			branchOfBone[i] = uint32_t(branches.depths.size());
+			branches.depths.push_back((parentBranch != BranchTable::None) ? branches.depths[parentBranch] + 1 : 1);
+			branches.parentBranches.push_back(parentBranch);
+			counts.push_back(0);
+		}
+		counts[branchOfBone[i] + 1]++;
+	}
 
-	turtle.actions['+'] = [&uniformGenerator, &iterations](Turtle& t, int repetitions)
+	for (size_t b = 1; b < counts.size(); b++)
 	{
-		float depth = float(t.activeBone->nodeDepth);
-
-		float rollBranchOffset = 45.0f*depth;
-		t.Rotate(
-			120.0f*repetitions + rollBranchOffset + uniformGenerator.RandomFloat(-30.0f, -30.0f),
-			25.0f + uniformGenerator.RandomFloat(-5.0f, 10.0f)
-		);
-
-		// Weigh down the branch based on iterations and length from root
-		glm::fvec3 rotVec = glm::cross(glm::fvec3{ 0.0f, 1.0f, 0.0f }, t.transform.forward);
-		float degrees = 3.0f * iterations/depth;
-		t.Rotate(degrees, rotVec);
-	};
+		counts[b] += counts[b - 1];
+	}
 
-	std::vector<FractalBranch> branches;
-	turtle.GenerateSkeleton(fractalTree.RunProduction(iterations));
-	BuildBranchesForFractalTree3D(branches, turtle.rootBone);
-	onResultCallback(turtle.rootBone, branches);
+	// Bones of a branch appear in chain order, so filling each row front to back keeps the chain order
+	branches.boneIndices.resize(size);
+	std::vector<uint32_t> cursors(branches.offsets.begin(), branches.offsets.end() - 1);
+	for (uint32_t i = 0; i < uint32_t(size); i++)
+	{
+		branches.boneIndices[cursors[branchOfBone[i]]++] = i;
+	}
 }
 
+TreeSkeleton::TreeSkeleton(BonePool<FractalTree3DProps>&& skeletonBones)
+	: bones{ std::move(skeletonBones) }
+{
+	BuildBranchesForFractalTree3D(branches, bones);
+}
 
-void GenerateFractalTree3D(TreeStyle style, UniformRandomGenerator& uniformGenerator, int iterations, int subdivisions, float applyRandomness, std::function<void(Bone<FractalTree3DProps>*, std::vector<FractalBranch>&)> onResultCallback)
+TreeSkeleton GenerateFractalTree3D(const SpeciesDescriptor& species, uint64_t seed, int iterations, int subdivisions, FractalTree3DGrammarCache* grammars)
 {
-	if (applyRandomness)
+	iterations *= 2;
+
+	// Without a cache the grammar is expanded from the axiom and nothing is kept
+	ModuleStream modules;
+	int maxBracketDepth = 0;
+	if (grammars)
 	{
-		GenerateFractalTree3DStochastic(style, uniformGenerator, iterations, subdivisions, onResultCallback);
+		modules = grammars->RunProduction(species, iterations, maxBracketDepth);
 	}
 	else
 	{
-		GenerateFractalTree3DBasic(style, uniformGenerator, iterations, subdivisions, onResultCallback);
+		ParametricLSystem fractalTree = FractalTree3DParametricGrammar(species);
+		modules = fractalTree.RunProduction(iterations);
+		maxBracketDepth = fractalTree.MaxBracketDepth(iterations);
 	}
+
+	// Sub-branches are interpreted in parallel, each with its own random stream derived from the seed.
+	// The blocks only depend on the module stream, so the skeleton is the same on any number of threads.
+	Turtle3D<FractalTree3DProps> turtle;
+	turtle.ReserveStates(maxBracketDepth);
+	auto makeActions = [&species, iterations, subdivisions](UniformRandomGenerator& generator) { return FractalTree3DActions{ species, generator, iterations, subdivisions }; };
+	turtle.GenerateSkeletonParallel(modules, makeActions, seed);
+
+	return TreeSkeleton{ std::move(turtle.bones) };
+}
+
+TreeSkeleton GenerateFractalTree3D(const GrammarProgram& species, uint64_t seed, uint64_t ruleSeed, int iterations)
+{
+	Turtle3D<FractalTree3DProps> turtle;
+	UniformRandomGenerator uniformGenerator{ seed };
+	species.GenerateSkeleton(turtle, uniformGenerator, iterations, ruleSeed);
+
+	return TreeSkeleton{ std::move(turtle.bones) };
 }
\ No newline at end of file
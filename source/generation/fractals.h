@@ -2,14 +2,29 @@
 #include "../opengl/canvas.h"
 #include "../core/randomization.h"
 #include "lsystem.h"
+#include "parametric.h"
+#include "grammarfile.h"
 #include "turtle2d.h"
 #include "turtle3d.h"
+#include <mutex>
+#include <tuple>
+
+LSystemString FractalTreeGrammar();
+LSystemString KochCurveGrammar();
+LSystemString SierpinskiTriangleGrammar();
+LSystemString DragonCurveGrammar();
+LSystemString FractalPlantGrammar();
+LSystemString FractalTreeNezumiV1Grammar();
+LSystemString FractalTreeNezumiV2Grammar();
+LSystemString FractalLeafGrammar();
+LSystemContextSensitive SignalPropagationGrammar();
 
 void DrawFractalTree(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawKochCurve(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawSierpinskiTriangle(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawDragonCurve(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawFractalPlant(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
+void DrawSignalPropagationPlant(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawFractalTreeNezumiV1(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawFractalTreeNezumiV2(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
 void DrawFractalTreeNezumiV3(Canvas2D& canvas, int iterations, float scale = 10.0f, glm::fvec2 origin = glm::fvec2{ 0.0f }, float startAngle = 90);
@@ -19,16 +34,11 @@ template<class T>
 void GenerateFractalPlant3D(Turtle3D<T>& turtle, UniformRandomGenerator& uniformGenerator, int iterations, float scale = 0.1f)
 {
 	using Turtle = Turtle3D<T>;
-	LSystemStringFunctional fractalTree;
+	LSystemStochastic fractalTree;
 	fractalTree.axiom = "0";
-	fractalTree.productionRules['0'] = [&uniformGenerator]() -> std::string
-	{
-		return (uniformGenerator.RandomFloat() < 0.5f) ? "1[0][0]0" : "1[0]0";
-	};
-	fractalTree.productionRules['1'] = [&uniformGenerator]() -> std::string
-	{
-		return "11";
-	};
+	fractalTree.seed = uniformGenerator.RandomInt();
+	fractalTree.productionRules['0'] = { { "1[0][0]0", 0.5f }, { "1[0]0", 0.5f } };
+	fractalTree.productionRules['1'] = { { "11" } };
 
 	turtle.actions['0'] = [scale, &uniformGenerator](Turtle& t, int repetitions)
 	{
@@ -55,7 +65,7 @@ void GenerateFractalPlant3D(Turtle3D<T>& turtle, UniformRandomGenerator& uniform
 			45.0f*uniformGenerator.RandomFloat(0.2f, 1.0f));
 	};
 
-	turtle.GenerateSkeleton(fractalTree.RunProduction(iterations));
+	turtle.GenerateSkeleton(fractalTree, iterations);
 }
 
 
@@ -64,27 +74,61 @@ struct FractalTree3DProps
 	float lengthFactor = 1.1f;	// How much the bone should grow
 };
 
-struct FractalBranch
+// Branch decomposition of a FractalTree3D skeleton as compressed sparse rows. Branch b is the chain of bone indices
+// boneIndices[offsets[b], offsets[b + 1]), every bone after the first is the lastChild of the bone before it.
+// Branches are numbered in the pre-order of their first bone, so a parent branch always comes before its children.
+struct BranchTable
 {
-	using TBone = Bone<FractalTree3DProps>;
+	static constexpr uint32_t None = UINT32_MAX;
+
+	std::vector<uint32_t> boneIndices;		// indices into the BonePool (and the FlatSkeleton built from it)
+	std::vector<uint32_t> offsets = { 0 };
+	std::vector<int> depths;				// 1 for the trunk, parent branch depth + 1 for the others
+	std::vector<uint32_t> parentBranches;	// None for the trunk
+
+	size_t Size() const
+	{
+		return depths.size();
+	}
 
-	int depth = 1;
-	std::vector<TBone*> nodes;
+	const uint32_t* Bones(size_t branch) const
+	{
+		return boneIndices.data() + offsets[branch];
+	}
 
-	FractalBranch(TBone* root, int rootDepth)
-		: depth{ rootDepth }
+	int BoneCount(size_t branch) const
 	{
-		Push(root);
+		return int(offsets[branch + 1] - offsets[branch]);
 	}
 
-	void Push(TBone* node)
+	bool IsLeaf(size_t branch) const
 	{
-		nodes.push_back(node);
+		return BoneCount(branch) == 1;
 	}
 
-	bool IsLeaf()
+	void Clear()
 	{
-		return (nodes.size() == 1);
+		boneIndices.clear();
+		offsets.resize(1);
+		depths.clear();
+		parentBranches.clear();
+	}
+};
+
+// A generated FractalTree3D, owns its bones and their branch decomposition. It outlives the turtle that built it,
+// so it can be cached, meshed several times (e.g. for LODs) or moved to another thread. Moving is cheap,
+// copying copies every array.
+struct TreeSkeleton
+{
+	BonePool<FractalTree3DProps> bones;
+	BranchTable branches;
+
+	TreeSkeleton() = default;
+	explicit TreeSkeleton(BonePool<FractalTree3DProps>&& skeletonBones); // takes the bones and builds the branch table
+
+	bool Empty() const
+	{
+		return bones.Empty();
 	}
 };
 
@@ -93,4 +137,149 @@ enum class TreeStyle
 	Default,
 	Slim
 };
-void GenerateFractalTree3D(TreeStyle style, UniformRandomGenerator& uniformGenerator, int iterations, int subdivisions, float applyRandomness, std::function<void(Bone<FractalTree3DProps>*, std::vector<FractalBranch>&)> onResultCallback);
+
+// Everything that sets one FractalTree3D species apart from another. One pipeline (FractalTree3DParametricGrammar,
+// FractalTree3DActions and the meshing in MeshTree) reads it, so a new species is a new descriptor, not new code.
+// Only 4 byte fields, so the descriptor has no padding and Hash can read it as raw bytes.
+struct SpeciesDescriptor
+{
+	// Grammar, C -> A(trunkSegments) [+B] [++B] ... B with sideBranches brackets
+	int32_t trunkSegments = 1;
+	int32_t sideBranches = 3;
+	float branchScale = 0.87f;				// length of a child branch relative to its parent
+
+	// Turtle
+	float sideBranchRoll = 120.0f;			// roll between neighbouring side branches
+	float depthRoll = 45.0f;				// extra roll per node depth, so the levels of the tree do not line up
+	float branchPitch = 25.0f;
+	float gravity = 3.0f;					// weighs the branches down, times grammar iterations over node depth
+	RandomRange lengthVariation{ 1.0f, 1.5f };
+	RandomRange growRoll{ 0.0f, 45.0f };	// spread over the subdivisions of a grown segment
+	RandomRange growPitch{ -15.0f, 15.0f };
+	RandomRange branchRollVariation{ -30.0f, -30.0f };
+	RandomRange branchPitchVariation{ -5.0f, 10.0f };
+
+	// Branch mesh
+	float trunkThickness = 0.5f;			// multiplied by trunkThicknessGrowth for every iteration
+	float trunkThicknessGrowth = 1.3f;
+	float branchThickness = 0.4f;			// thickness of a branch relative to its parent
+	float depthThinning = 0.75f;			// thickness kept per bone along a branch (per subdivided segment)
+	int32_t trunkCylinderDivisions = 32;	// halved for every branch depth
+
+	// Leaves
+	RandomRange leafScale{ 0.25f, 1.5f };
+	int32_t leavesPerBone = 25;
+	int32_t leafThinning = 20;				// bigger trees lose up to this many leaves per bone
+
+	// Same descriptor with the random ranges of the turtle collapsed to their neutral values, the skeleton
+	// then no longer depends on the seed
+	SpeciesDescriptor WithoutRandomness() const;
+
+	uint64_t Hash() const;
+};
+
+SpeciesDescriptor FractalTree3DSpecies(TreeStyle style);
+
+// Turtle actions for the modules of FractalTree3DParametricGrammar, used as a compile-time action policy
+// by Turtle3D::GenerateSkeleton. A(count, scale) and C(count, scale) grow the branch, +(count) turns it.
+struct FractalTree3DActions
+{
+	using Turtle = Turtle3D<FractalTree3DProps>;
+
+	const SpeciesDescriptor& species;
+	UniformRandomGenerator& uniformGenerator;
+	int iterations = 1;			// grammar iterations, the branches are weighed down more in bigger trees
+	int subdivisions = 1;
+	float subDivFactor = 1.0f;
+
+	FractalTree3DActions(const SpeciesDescriptor& speciesDescriptor, UniformRandomGenerator& generator, int grammarIterations, int treeSubdivisions)
+		: species{ speciesDescriptor }, uniformGenerator{ generator }, iterations{ grammarIterations }
+	{
+		subdivisions = (treeSubdivisions == 0) ? 1 : treeSubdivisions;
+		subDivFactor = 1.0f / float(subdivisions);
+	}
+
+	void operator()(Turtle& t, char symbol, const float* p, int count)
+	{
+		switch (symbol)
+		{
+		case 'A':
+		case 'C': Grow(t, p[0], p[1]); break;
+		case '[': t.PushState(); break;
+		case ']': t.PopState(); break;
+		case '+': Turn(t, int(p[0])); break;
+		default: break;
+		}
+	}
+
+	void Grow(Turtle& t, float count, float scale)
+	{
+		t.transform.properties.lengthFactor = scale;
+		float randomLengthFactor = species.lengthVariation.Draw(uniformGenerator);
+		float drawLength = subDivFactor * count * randomLengthFactor * scale;
+		float roll		 = subDivFactor * species.growRoll.Draw(uniformGenerator);
+		float pitch		 = subDivFactor * species.growPitch.Draw(uniformGenerator);
+
+		// Species without randomness do not turn while growing, skipping the no-op rotations also keeps
+		// the frame orthonormalized at the same bones
+		bool rotate = (roll != 0.0f || pitch != 0.0f);
+		for (int d = 0; d < subdivisions; d++)
+		{
+			if (rotate) t.Rotate(roll, pitch);
+			t.MoveForward(drawLength);
+		}
+	}
+
+	void Turn(Turtle& t, int repetitions)
+	{
+		float depth = float(t.ActiveBone()->nodeDepth);
+		float rollBranchOffset = species.depthRoll*depth;
+		t.Rotate(
+			species.sideBranchRoll*repetitions + rollBranchOffset + species.branchRollVariation.Draw(uniformGenerator),
+			species.branchPitch + species.branchPitchVariation.Draw(uniformGenerator)
+		);
+
+		// Weigh down the branch based on iterations and length from root
+		glm::fvec3 rotVec = glm::cross(glm::fvec3{ 0.0f, 1.0f, 0.0f }, t.transform.forward);
+		float degrees = species.gravity * iterations / depth;
+		t.Rotate(degrees, rotVec);
+	}
+};
+
+// Expanded FractalTree3D grammars, kept between trees so stepping the iteration count up only expands what is missing.
+// Owned by the caller and safe to share between threads. Only the iterations up to the last one asked for are kept,
+// so stepping back down frees the bigger productions, and at most MaxGrammars grammars, the least recently used goes first.
+class FractalTree3DGrammarCache
+{
+public:
+	static constexpr size_t MaxGrammars = 4;
+
+	FractalTree3DGrammarCache() = default;
+	~FractalTree3DGrammarCache() = default;
+
+	// Production after the given number of grammar iterations and its deepest bracket nesting
+	ModuleStream RunProduction(const SpeciesDescriptor& species, int iterations, int& maxBracketDepth);
+
+	size_t MemoryBytes() const;
+	void Clear();
+
+protected:
+	// trunkSegments, sideBranches and the bits of branchScale, compared exactly
+	using GrammarKey = std::tuple<int32_t, int32_t, uint32_t>;
+
+	struct CachedGrammar
+	{
+		ParametricLSystem lsystem;
+		uint64_t lastUse = 0;
+	};
+
+	mutable std::mutex mutex;
+	std::map<GrammarKey, CachedGrammar> grammars;
+	uint64_t useCount = 0;
+};
+
+LSystemString FractalTree3DGrammar(const SpeciesDescriptor& species);
+ParametricLSystem FractalTree3DParametricGrammar(const SpeciesDescriptor& species);
+void BuildBranchesForFractalTree3D(BranchTable& branches, const BonePool<FractalTree3DProps>& bones);
+TreeSkeleton GenerateFractalTree3D(const GrammarProgram& species, uint64_t seed, uint64_t ruleSeed, int iterations);
+TreeSkeleton GenerateFractalTree3D(const SpeciesDescriptor& species, uint64_t seed, int iterations, int subdivisions, FractalTree3DGrammarCache* grammars = nullptr);
@@ -0,0 +1,381 @@
+#include "grammarfile.h"
+#include "../core/utilities.h"
+#include <sstream>
+#include <cstdlib>
+
+bool ParseFloat(const std::string& token, float& value)
+{
+	if (token.empty()) return false;
+
+	char* end = nullptr;
+	value = std::strtof(token.c_str(), &end);
+	return end == token.c_str() + token.size();
+}
+
+bool GrammarProgram::Load(std::filesystem::path filePath)
+{
+	std::string text;
+	if (!LoadText(filePath, text))
+	{
+		error = "Failed to read " + filePath.string();
+		return false;
+	}
+
+	return Parse(text);
+}
+
+bool GrammarProgram::Parse(const std::string& text)
+{
+	// Parsed into a new program so a file with errors leaves the loaded one in place
+	GrammarProgram program;
+	program.sourceHash = HashBytes(text.data(), text.size());
+
+	std::istringstream lines(text);
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(lines, line))
+	{
+		lineNumber++;
+		if (!program.ParseLine(line, lineNumber))
+		{
+			error = program.error;
+			return false;
+		}
+	}
+
+	if (program.lsystem.axiom.empty())
+	{
+		error = "Missing axiom";
+		return false;
+	}
+
+	*this = std::move(program);
+	return true;
+}
+
+bool GrammarProgram::ParseLine(const std::string& line, int lineNumber)
+{
+	std::string content = line.substr(0, line.find('#'));
+	if (!content.empty() && content.back() == '\r') content.pop_back();
+
+	std::istringstream tokens(content);
+	std::string keyword;
+	if (!(tokens >> keyword))
+	{
+		return true; // empty line or comment
+	}
+
+	auto fail = [this, lineNumber](const std::string& message) -> bool
+	{
+		error = "Line " + std::to_string(lineNumber) + ": " + message;
+		return false;
+	};
+
+	// Symbol strings are single words, e.g. a space in a successor would otherwise cut it short silently
+	std::string extra;
+	auto hasExtra = [&tokens, &extra]() -> bool
+	{
+		return bool(tokens >> extra);
+	};
+
+	if (keyword == "axiom")
+	{
+		if (!(tokens >> lsystem.axiom)) return fail("axiom needs a symbol string");
+		if (hasExtra()) return fail("unexpected '" + extra + "'");
+	}
+	else if (keyword == "seed")
+	{
+		unsigned long long seed = 0;
+		if (!(tokens >> seed)) return fail("seed needs a number");
+		if (hasExtra()) return fail("unexpected '" + extra + "'");
+		lsystem.seed = uint64_t(seed);
+	}
+	else if (keyword == "rule")
+	{
+		// rule <symbol> [weight] -> <successor>
+		std::string symbol, token, successor;
+		if (!(tokens >> symbol) || symbol.size() != 1) return fail("rule needs a single character symbol");
+		if (!(tokens >> token)) return fail("rule is missing ->");
+
+		float weight = 1.0f;
+		if (token != "->")
+		{
+			if (!ParseFloat(token, weight)) return fail("invalid rule weight '" + token + "'");
+			if (!(tokens >> token) || token != "->") return fail("rule is missing ->");
+		}
+		tokens >> successor; // an empty successor removes the symbol
+		if (hasExtra()) return fail("unexpected '" + extra + "'");
+
+		lsystem.productionRules[symbol[0]].push_back(LSystemStochastic::Alternative{ successor, weight });
+	}
+	else if (keyword == "turtle")
+	{
+		// turtle <symbol> <command> [min [max]]; <command> ...
+		std::string symbol, commands;
+		if (!(tokens >> symbol) || symbol.size() != 1) return fail("turtle needs a single character symbol");
+		std::getline(tokens, commands);
+		return ParseTurtleCommands(symbol[0], commands, lineNumber);
+	}
+	else
+	{
+		return fail("unknown keyword '" + keyword + "'");
+	}
+
+	return true;
+}
+
+bool GrammarProgram::ParseTurtleCommands(char symbol, const std::string& commands, int lineNumber)
+{
+	auto fail = [this, lineNumber](const std::string& message) -> bool
+	{
+		error = "Line " + std::to_string(lineNumber) + ": " + message;
+		return false;
+	};
+
+	// A symbol that is defined again replaces its previous commands, the old ones stay unused in the array
+	InstructionRange& range = symbolInstructions[(unsigned char)symbol];
+	range.first = uint32_t(instructions.size());
+	range.count = 0;
+
+	std::istringstream commandList(commands);
+	std::string command;
+	while (std::getline(commandList, command, ';'))
+	{
+		std::istringstream tokens(command);
+		std::string name;
+		if (!(tokens >> name)) continue;
+
+		std::vector<float> operands;
+		std::string token;
+		while (tokens >> token)
+		{
+			float value = 0.0f;
+			if (!ParseFloat(token, value)) return fail("invalid number '" + token + "' in " + name);
+			operands.push_back(value);
+		}
+
+		TurtleInstruction instruction;
+		size_t expectedOperands = 1;
+		if      (name == "forward") instruction.opcode = TurtleOpcode::Forward;
+		else if (name == "roll")    instruction.opcode = TurtleOpcode::Roll;
+		else if (name == "pitch")   instruction.opcode = TurtleOpcode::Pitch;
+		else if (name == "scale")   instruction.opcode = TurtleOpcode::Scale;
+		else if (name == "push")  { instruction.opcode = TurtleOpcode::Push; expectedOperands = 0; }
+		else if (name == "pop")   { instruction.opcode = TurtleOpcode::Pop;  expectedOperands = 0; }
+		else return fail("unknown turtle command '" + name + "'");
+
+		if (expectedOperands == 0 && !operands.empty()) return fail(name + " takes no numbers");
+		if (expectedOperands == 1 && (operands.empty() || operands.size() > 2)) return fail(name + " needs a value or a min and max value");
+
+		if (!operands.empty())
+		{
+			instruction.minimum = operands[0];
+			instruction.maximum = (operands.size() == 2) ? operands[1] : operands[0];
+		}
+
+		instructions.push_back(instruction);
+		range.count++;
+	}
+
+	return true;
+}
+
+
+/*
+	TurtleMacroCompiler
+*/
+uint32_t TurtleMacroOp::RandomDraws() const
+{
+	switch (opcode)
+	{
+	case TurtleMacroOpcode::Turn:
+		return uint32_t((parts & HasRoll) && roll.IsRandom())
+			+ uint32_t((parts & HasPitch) && pitch.IsRandom())
+			+ uint32_t((parts & HasForward) && value.IsRandom());
+	case TurtleMacroOpcode::Scale: return value.IsRandom() ? 1 : 0;
+	case TurtleMacroOpcode::Skip:  return skipCount;
+	default: return 0;
+	}
+}
+
+void TurtleMacroCompiler::Add(const TurtleInstruction& instruction)
+{
+	instructionCount++;
+	RandomRange range{ instruction.minimum, instruction.maximum };
+
+	switch (instruction.opcode)
+	{
+	case TurtleOpcode::Forward:
+		AddTurn(TurtleMacroOp::HasForward, instruction);
+
+		// The innermost brackets are the ones without a forward yet
+		for (size_t i = openBrackets.size(); emptyBrackets > 0 && i-- > 0;)
+		{
+			openBrackets[i].hasForward = true;
+			emptyBrackets--;
+		}
+		break;
+
+	case TurtleOpcode::Roll:  AddTurn(TurtleMacroOp::HasRoll, instruction); break;
+	case TurtleOpcode::Pitch: AddTurn(TurtleMacroOp::HasPitch, instruction); break;
+
+	case TurtleOpcode::Scale:
+	{
+		if (range.IsRandom())
+		{
+			TurtleMacroOp op;
+			op.opcode = TurtleMacroOpcode::Scale;
+			op.value = range;
+			Emit(op);
+			break;
+		}
+
+		// A constant scale only matters to the next forward, so it can go in front of a turn that has not moved yet
+		size_t position = ops.size();
+		if (position > 0 && ops[position - 1].opcode == TurtleMacroOpcode::Turn && !(ops[position - 1].parts & TurtleMacroOp::HasForward))
+		{
+			position--;
+		}
+
+		if (position > 0 && ops[position - 1].opcode == TurtleMacroOpcode::Scale && !ops[position - 1].value.IsRandom())
+		{
+			ops[position - 1].value.min *= range.min;
+			ops[position - 1].value.max *= range.min;
+			break;
+		}
+
+		TurtleMacroOp op;
+		op.opcode = TurtleMacroOpcode::Scale;
+		op.value = range;
+		ops.insert(ops.begin() + position, op);
+		opCount++;
+		break;
+	}
+
+	case TurtleOpcode::Push:
+	{
+		TurtleMacroOp op;
+		op.opcode = TurtleMacroOpcode::Push;
+		Emit(op);
+		openBrackets.push_back(OpenBracket{ ops.size() - 1, false });
+		emptyBrackets++;
+		break;
+	}
+
+	case TurtleOpcode::Pop:
+	{
+		if (openBrackets.empty())
+		{
+			break;
+		}
+
+		OpenBracket bracket = openBrackets.back();
+		openBrackets.pop_back();
+		if (bracket.hasForward)
+		{
+			TurtleMacroOp op;
+			op.opcode = TurtleMacroOpcode::Pop;
+			Emit(op);
+			break;
+		}
+
+		// Nothing in the pair outlives the pop except the random values it drew
+		emptyBrackets--;
+		uint32_t draws = 0;
+		for (size_t i = bracket.op + 1; i < ops.size(); i++)
+		{
+			draws += ops[i].RandomDraws();
+		}
+		opCount -= ops.size() - bracket.op;
+		ops.resize(bracket.op);
+
+		if (draws > 0)
+		{
+			if (!ops.empty() && ops.back().opcode == TurtleMacroOpcode::Skip)
+			{
+				ops.back().skipCount += draws;
+			}
+			else
+			{
+				TurtleMacroOp op;
+				op.opcode = TurtleMacroOpcode::Skip;
+				op.skipCount = draws;
+				Emit(op);
+			}
+		}
+		break;
+	}
+	}
+}
+
+void TurtleMacroCompiler::AddTurn(uint8_t part, const TurtleInstruction& instruction)
+{
+	RandomRange range{ instruction.minimum, instruction.maximum };
+
+	if (!ops.empty() && ops.back().opcode == TurtleMacroOpcode::Turn)
+	{
+		TurtleMacroOp& last = ops.back();
+		uint8_t laterParts = uint8_t(~(part | (part - 1)));
+		if (!(last.parts & laterParts))
+		{
+			RandomRange& target = (part == TurtleMacroOp::HasRoll) ? last.roll : (part == TurtleMacroOp::HasPitch) ? last.pitch : last.value;
+			if (!(last.parts & part))
+			{
+				target = range;
+				last.parts |= part;
+				return;
+			}
+
+			// Two rotations around the same axis add up, as long as that draws at most one random value
+			if (part != TurtleMacroOp::HasForward && (!target.IsRandom() || !range.IsRandom()))
+			{
+				target.min += range.min;
+				target.max += range.max;
+				return;
+			}
+		}
+	}
+
+	TurtleMacroOp op;
+	op.opcode = TurtleMacroOpcode::Turn;
+	op.parts = part;
+	(part == TurtleMacroOp::HasRoll ? op.roll : part == TurtleMacroOp::HasPitch ? op.pitch : op.value) = range;
+	Emit(op);
+}
+
+void TurtleMacroCompiler::Emit(const TurtleMacroOp& op)
+{
+	ops.push_back(op);
+	opCount++;
+}
+
+size_t TurtleMacroCompiler::SettledCount() const
+{
+	if (isFinished)
+	{
+		return ops.size();
+	}
+
+	// The last two ops can still take fused instructions and anything from an empty bracket on may be removed
+	size_t settled = (ops.size() > 2) ? ops.size() - 2 : 0;
+	if (emptyBrackets > 0)
+	{
+		size_t firstEmpty = openBrackets[openBrackets.size() - emptyBrackets].op;
+		settled = (firstEmpty < settled) ? firstEmpty : settled;
+	}
+	return settled;
+}
+
+void TurtleMacroCompiler::Discard(size_t count)
+{
+	ops.erase(ops.begin(), ops.begin() + count);
+	for (size_t i = openBrackets.size() - emptyBrackets; i < openBrackets.size(); i++)
+	{
+		openBrackets[i].op -= count;
+	}
+}
+
+void TurtleMacroCompiler::Finish()
+{
+	isFinished = true;
+}
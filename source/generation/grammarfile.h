@@ -0,0 +1,244 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include "lsystem.h"
+#include "turtle3d.h"
+#include "../core/randomization.h"
+
+/*
+	Text format for an L-system and the turtle commands of its symbols, one statement per line:
+
+		# comment
+		axiom B
+		seed 42
+		rule B -> AAA[%^B][%+^B][%++^B]%B
+		rule X 0.25 -> X[X]		(optional weight, several rules for one symbol are stochastic alternatives)
+		turtle A roll 0 15; pitch -5 5; forward 1 1.5
+		turtle % scale 0.87
+		turtle [ push
+		turtle ] pop
+
+	The axiom and a successor are single words, they can not contain spaces and anything after them on the line
+	is an error. A rule with nothing after -> removes its symbol.
+
+	Turtle commands: forward, roll, pitch, scale, push, pop. A command with two numbers picks
+	a uniform random value between them every time it runs. Distances are multiplied by the current scale.
+*/
+
+enum class TurtleOpcode : uint8_t
+{
+	Forward,
+	Roll,
+	Pitch,
+	Scale,
+	Push,
+	Pop
+};
+
+struct TurtleInstruction
+{
+	TurtleOpcode opcode = TurtleOpcode::Forward;
+	float minimum = 0.0f;
+	float maximum = 0.0f;
+};
+
+// Turtle work after peephole fusion of the instruction stream, see TurtleMacroCompiler
+enum class TurtleMacroOpcode : uint8_t
+{
+	Turn,	// roll, then pitch, then forward, each part is optional
+	Scale,
+	Push,
+	Pop,
+	Skip	// draws and discards random values, what is left of a [ ] pair that enclosed no bones
+};
+
+struct TurtleMacroOp
+{
+	static constexpr uint8_t HasRoll = 1;
+	static constexpr uint8_t HasPitch = 2;
+	static constexpr uint8_t HasForward = 4;
+
+	TurtleMacroOpcode opcode = TurtleMacroOpcode::Turn;
+	uint8_t parts = 0;			// Has* flags of a Turn
+	uint32_t skipCount = 0;		// random values drawn by a Skip
+	RandomRange roll;
+	RandomRange pitch;
+	RandomRange value;			// forward distance of a Turn, factor of a Scale
+
+	uint32_t RandomDraws() const;
+};
+
+// Fuses a stream of turtle instructions into fewer macro ops, without changing the random values drawn or the bones:
+//  - roll, pitch and forward in that order become one Turn, "rotate then move" is one op
+//  - consecutive rolls or pitches add up, when at most one of them is random (rotations around the same axis)
+//  - constant scales multiply and move in front of rotations, they only affect forward
+//  - a [ ] pair without a forward in between is removed, only its random draws are kept as a Skip
+//  - a pop without a push is dropped, the interpreter ignores it anyway
+// Ops are handed out as soon as no later instruction can change them, so the buffer stays small while streaming.
+class TurtleMacroCompiler
+{
+public:
+	std::vector<TurtleMacroOp> ops;
+	uint64_t instructionCount = 0;
+	uint64_t opCount = 0;
+
+	void Add(const TurtleInstruction& instruction);
+
+	// ops[0, SettledCount()) can be run, later instructions only fuse into ops that are still in the buffer
+	size_t SettledCount() const;
+	void Discard(size_t count); // removes ops that have been run from the front
+
+	// No more instructions, every op is final
+	void Finish();
+
+protected:
+	struct OpenBracket
+	{
+		size_t op = 0;			// index of the Push in ops
+		bool hasForward = false;
+	};
+
+	std::vector<OpenBracket> openBrackets;
+	size_t emptyBrackets = 0;	// open brackets without a forward, they are always the innermost ones
+	bool isFinished = false;
+
+	void Emit(const TurtleMacroOp& op);
+	void AddTurn(uint8_t part, const TurtleInstruction& instruction);
+};
+
+// A parsed grammar file. The turtle commands are compiled into one flat instruction array
+// and every symbol maps to a slice of it, so interpreting a symbol is a table lookup and a switch.
+class GrammarProgram
+{
+public:
+	struct InstructionRange
+	{
+		uint32_t first = 0;
+		uint32_t count = 0;
+	};
+
+	LSystemStochastic lsystem;
+	std::vector<TurtleInstruction> instructions;
+	std::array<InstructionRange, 256> symbolInstructions{};
+	std::string error = ""; // description of the first problem found by Parse
+	uint64_t sourceHash = 0; // hash of the parsed text, identifies the species e.g. in the tree cache
+
+	GrammarProgram() = default;
+	GrammarProgram(GrammarProgram&&) = default;
+	GrammarProgram& operator=(GrammarProgram&&) = default;
+	~GrammarProgram() = default;
+
+	bool Parse(const std::string& text);
+	bool Load(std::filesystem::path filePath);
+
+	const InstructionRange& Find(char symbol) const
+	{
+		return symbolInstructions[(unsigned char)symbol];
+	}
+
+	// Streams the L-system through the peephole compiler and runs the fused ops. Same bones and random draws
+	// as running every instruction one by one, the frames only differ by rounding.
+	template<class T>
+	void GenerateSkeleton(Turtle3D<T>& turtle, UniformRandomGenerator& uniformGenerator, int iterations) const
+	{
+		GenerateSkeleton(turtle, uniformGenerator, iterations, lsystem.seed);
+	}
+
+	// Same, with ruleSeed in place of the seed of the grammar file picking the rule alternatives
+	template<class T>
+	void GenerateSkeleton(Turtle3D<T>& turtle, UniformRandomGenerator& uniformGenerator, int iterations, uint64_t ruleSeed) const
+	{
+		turtle.Clear();
+
+		int maxBracketDepth = lsystem.MaxBracketDepth(iterations);
+		turtle.ReserveStates(maxBracketDepth);
+
+		float scale = 1.0f;
+		std::vector<float> scaleStack;
+		scaleStack.reserve(maxBracketDepth);
+
+		TurtleMacroCompiler compiler;
+		auto runSettled = [&]()
+		{
+			size_t count = compiler.SettledCount();
+			for (size_t i = 0; i < count; i++)
+			{
+				RunMacroOp(turtle, compiler.ops[i], uniformGenerator, scale, scaleStack);
+			}
+			compiler.Discard(count);
+		};
+
+		CompiledLSystem rules = lsystem.Compile();
+		rules.seed = ruleSeed;
+
+		const TurtleInstruction* program = instructions.data();
+		rules.StreamProduction(iterations, [&](char c)
+		{
+			const InstructionRange& range = Find(c);
+			const TurtleInstruction* end = program + range.first + range.count;
+			for (const TurtleInstruction* instruction = program + range.first; instruction != end; instruction++)
+			{
+				compiler.Add(*instruction);
+			}
+
+			if (compiler.ops.size() >= 1024)
+			{
+				runSettled();
+			}
+		});
+		compiler.Finish();
+		runSettled();
+	}
+
+	template<class T>
+	static void RunMacroOp(Turtle3D<T>& turtle, const TurtleMacroOp& op, UniformRandomGenerator& uniformGenerator, float& scale, std::vector<float>& scaleStack)
+	{
+		switch (op.opcode)
+		{
+		case TurtleMacroOpcode::Turn:
+		{
+			float roll = (op.parts & TurtleMacroOp::HasRoll) ? op.roll.DrawIfRandom(uniformGenerator) : 0.0f;
+			float pitch = (op.parts & TurtleMacroOp::HasPitch) ? op.pitch.DrawIfRandom(uniformGenerator) : 0.0f;
+			uint8_t rotation = op.parts & (TurtleMacroOp::HasRoll | TurtleMacroOp::HasPitch);
+			if (rotation == (TurtleMacroOp::HasRoll | TurtleMacroOp::HasPitch))
+			{
+				turtle.Rotate(roll, pitch);
+			}
+			else if (rotation == TurtleMacroOp::HasRoll)
+			{
+				turtle.Rotate(roll, turtle.transform.forward);
+			}
+			else if (rotation == TurtleMacroOp::HasPitch)
+			{
+				turtle.Rotate(pitch, glm::cross(turtle.transform.forward, turtle.transform.up));
+			}
+
+			if (op.parts & TurtleMacroOp::HasForward)
+			{
+				turtle.MoveForward(op.value.DrawIfRandom(uniformGenerator) * scale);
+			}
+			break;
+		}
+		case TurtleMacroOpcode::Scale: scale *= op.value.DrawIfRandom(uniformGenerator); break;
+		case TurtleMacroOpcode::Push:  turtle.PushState(); scaleStack.push_back(scale); break;
+		case TurtleMacroOpcode::Pop:
+			turtle.PopState();
+			scale = scaleStack.back();
+			scaleStack.pop_back();
+			break;
+		case TurtleMacroOpcode::Skip:
+			for (uint32_t i = 0; i < op.skipCount; i++)
+			{
+				uniformGenerator.RandomFloat();
+			}
+			break;
+		}
+	}
+
+protected:
+	bool ParseLine(const std::string& line, int lineNumber);
+	bool ParseTurtleCommands(char symbol, const std::string& commands, int lineNumber);
+};
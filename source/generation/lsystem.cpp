@@ -1,49 +1,766 @@
 #include "lsystem.h"
+#include "../core/threads.h"
+#include <algorithm>
 
+/*
+	CompiledLSystem
+*/
+CompiledLSystem::CompiledLSystem(const LSystemString& lsystem)
+	: axiom{ lsystem.axiom }
+{
+	for (auto& rule : lsystem.productionRules)
+	{
+		AddAlternative(rule.first, rule.second, 1.0f);
+	}
+	NormalizeProbabilities();
+}
+
+CompiledLSystem::CompiledLSystem(const LSystemStochastic& lsystem)
+	: axiom{ lsystem.axiom }, seed{ lsystem.seed }
+{
+	for (auto& rule : lsystem.productionRules)
+	{
+		for (auto& alternative : rule.second)
+		{
+			AddAlternative(rule.first, alternative.successor, alternative.weight);
+		}
+	}
+	NormalizeProbabilities();
+}
+
+void CompiledLSystem::AddAlternative(char symbol, const std::string& successor, float weight)
+{
+	Successor& entry = successors[(unsigned char)symbol];
+	if (!entry.isVariable)
+	{
+		entry.isVariable = true;
+		entry.firstAlternative = uint32_t(alternatives.size());
+		entry.alternativeCount = 0;
+	}
+
+	// Accumulate the weights for now, they are turned into probabilities once all rules are added
+	double previousWeight = (entry.alternativeCount > 0) ? alternatives.back().cumulativeProbability : 0.0;
+	double clampedWeight = (weight > 0.0f) ? double(weight) : 0.0;
+
+	Alternative alternative;
+	alternative.offset = uint32_t(successorSymbols.size());
+	alternative.length = uint32_t(successor.size());
+	alternative.cumulativeProbability = previousWeight + clampedWeight;
+	alternatives.push_back(alternative);
+
+	entry.alternativeCount++;
+	successorSymbols.append(successor);
+}
+
+void CompiledLSystem::NormalizeProbabilities()
+{
+	isDeterministic = true;
+	for (Successor& entry : successors)
+	{
+		if (!entry.isVariable) continue;
+
+		isDeterministic = isDeterministic && (entry.alternativeCount == 1);
+
+		Alternative* first = &alternatives[entry.firstAlternative];
+		double totalWeight = first[entry.alternativeCount - 1].cumulativeProbability;
+		for (uint32_t i = 0; i < entry.alternativeCount; i++)
+		{
+			// Without any positive weight the alternatives are equally likely
+			first[i].cumulativeProbability = (totalWeight > 0.0) ? first[i].cumulativeProbability / totalWeight : double(i + 1) / entry.alternativeCount;
+		}
+		first[entry.alternativeCount - 1].cumulativeProbability = 1.0;
+	}
+}
+
+std::string CompiledLSystem::RunProduction(int iterations) const
+{
+	std::string production = axiom;
+	std::string newString;
+
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		Rewrite(production, iteration, newString);
+		production.swap(newString);
+	}
+
+	return production;
+}
+
+void CompiledLSystem::Rewrite(const std::string& production, int iteration, std::string& output) const
+{
+	uint64_t variableOrdinal = 0;
+	output.clear();
+	for (char c : production)
+	{
+		const Successor& successor = Find(c);
+		if (successor.isVariable)
+		{
+			const Alternative& alternative = Choose(successor, iteration, variableOrdinal++);
+			output.append(SuccessorSymbols(alternative), alternative.length);
+		}
+		else
+		{
+			output.append(1, c);
+		}
+	}
+}
+
+std::string CompiledLSystem::RunProductionExact(int iterations) const
+{
+	// Stochastic rules have no exact length table, so they are measured with an extra streaming pass
+	uint64_t length = 0;
+	if (isDeterministic)
+	{
+		length = ProductionLength(iterations);
+	}
+	else
+	{
+		StreamProduction(iterations, [&length](char c)
+		{
+			length++;
+		});
+	}
+
+	std::string production;
+	production.resize(size_t(length));
+
+	char* output = &production[0];
+	StreamProduction(iterations, [&output](char c)
+	{
+		*output++ = c;
+	});
+
+	return production;
+}
+
+std::string CompiledLSystem::RunProductionParallel(int iterations, unsigned int threadCount) const
+{
+	// Passes shorter than this are not worth the thread startup
+	const size_t minSymbolsPerChunk = 1 << 16;
+
+	threadCount = (threadCount == 0) ? Threads::Count() : threadCount;
+	threadCount = (threadCount == 0) ? 1 : threadCount;
+
+	auto runChunks = [](size_t chunkCount, auto&& chunkFunction)
+	{
+		std::vector<std::thread> workers;
+		workers.reserve(chunkCount - 1);
+		for (size_t chunk = 1; chunk < chunkCount; chunk++)
+		{
+			workers.emplace_back(chunkFunction, chunk);
+		}
+		chunkFunction(size_t(0));
+
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+	};
+
+	std::string production = axiom;
+	std::string newString;
+	std::vector<size_t> chunkOffsets;
+	std::vector<uint64_t> chunkOrdinals;
+
+	for (int iteration = 0; iteration < iterations; iteration++)
+	{
+		size_t inputSize = production.size();
+		size_t chunkCount = inputSize / minSymbolsPerChunk;
+		chunkCount = (chunkCount < 1) ? 1 : (chunkCount > threadCount) ? threadCount : chunkCount;
+		size_t chunkSize = (inputSize + chunkCount - 1) / chunkCount;
+
+		auto chunkBegin = [&](size_t chunk) { return chunk * chunkSize; };
+		auto chunkEnd = [&](size_t chunk) { return (chunk * chunkSize + chunkSize < inputSize) ? chunk * chunkSize + chunkSize : inputSize; };
+
+		// Stochastic choices depend on the ordinal of each variable, so every chunk needs to know how many come before it
+		chunkOrdinals.assign(chunkCount + 1, 0);
+		if (!isDeterministic)
+		{
+			runChunks(chunkCount, [&](size_t chunk)
+			{
+				uint64_t variables = 0;
+				for (size_t i = chunkBegin(chunk); i < chunkEnd(chunk); i++)
+				{
+					variables += Find(production[i]).isVariable ? 1 : 0;
+				}
+				chunkOrdinals[chunk + 1] = variables;
+			});
+
+			for (size_t chunk = 0; chunk < chunkCount; chunk++)
+			{
+				chunkOrdinals[chunk + 1] += chunkOrdinals[chunk];
+			}
+		}
+
+		// Measure the output of each chunk
+		chunkOffsets.assign(chunkCount + 1, 0);
+		runChunks(chunkCount, [&](size_t chunk)
+		{
+			uint64_t variableOrdinal = chunkOrdinals[chunk];
+			size_t length = 0;
+			for (size_t i = chunkBegin(chunk); i < chunkEnd(chunk); i++)
+			{
+				const Successor& successor = Find(production[i]);
+				length += successor.isVariable ? Choose(successor, iteration, variableOrdinal++).length : 1;
+			}
+			chunkOffsets[chunk + 1] = length;
+		});
+
+		// Exclusive prefix sum gives the position of every chunk in the output
+		for (size_t chunk = 0; chunk < chunkCount; chunk++)
+		{
+			chunkOffsets[chunk + 1] += chunkOffsets[chunk];
+		}
+		newString.resize(chunkOffsets[chunkCount]);
+
+		// Rewrite all chunks into their slice of the shared output
+		runChunks(chunkCount, [&](size_t chunk)
+		{
+			uint64_t variableOrdinal = chunkOrdinals[chunk];
+			char* output = &newString[0] + chunkOffsets[chunk];
+			for (size_t i = chunkBegin(chunk); i < chunkEnd(chunk); i++)
+			{
+				char c = production[i];
+				const Successor& successor = Find(c);
+				if (successor.isVariable)
+				{
+					const Alternative& alternative = Choose(successor, iteration, variableOrdinal++);
+					const char* symbols = SuccessorSymbols(alternative);
+					output = std::copy(symbols, symbols + alternative.length, output);
+				}
+				else
+				{
+					*output++ = c;
+				}
+			}
+		});
+
+		production.swap(newString);
+	}
+
+	return production;
+}
+
+uint64_t CompiledLSystem::ProductionLength(int iterations) const
+{
+	SymbolLengthTable table = ComputeLengthTable(iterations);
+
+	uint64_t length = 0;
+	for (char c : axiom)
+	{
+		uint64_t symbolLength = table.back()[(unsigned char)c];
+		length = (length > UINT64_MAX - symbolLength) ? UINT64_MAX : length + symbolLength;
+	}
+	return length;
+}
+
+SymbolLengthTable CompiledLSystem::ComputeLengthTable(int iterations) const
+{
+	iterations = (iterations < 0) ? 0 : iterations;
+
+	SymbolLengthTable table(size_t(iterations) + 1);
+	table[0].fill(1);
+
+	for (int k = 1; k <= iterations; k++)
+	{
+		auto& previous = table[k - 1];
+		auto& current = table[k];
+		current = previous;
+
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			const Successor& successor = successors[symbol];
+			if (!successor.isVariable) continue;
+
+			uint64_t longest = 0;
+			for (uint32_t a = 0; a < successor.alternativeCount; a++)
+			{
+				const Alternative& alternative = alternatives[successor.firstAlternative + a];
+				const char* symbols = SuccessorSymbols(alternative);
+
+				uint64_t length = 0;
+				for (uint32_t i = 0; i < alternative.length; i++)
+				{
+					uint64_t symbolLength = previous[(unsigned char)symbols[i]];
+					length = (length > UINT64_MAX - symbolLength) ? UINT64_MAX : length + symbolLength;
+				}
+				longest = (length > longest) ? length : longest;
+			}
+			current[symbol] = longest;
+		}
+	}
+
+	return table;
+}
+
+// What the expansion of one symbol looks like, as expected values
+struct ExpansionStatistics
+{
+	std::array<double, 256> counts{};
+	std::array<double, 256> first{};	// probability that the expansion starts with the symbol
+	std::array<double, 256> last{};		// probability that the expansion ends with the symbol
+	std::array<double, 256> pairs{};	// expected number of neighbouring equal symbols
+	double emptyProbability = 1.0;
+
+	void SetSymbol(char symbol)
+	{
+		*this = ExpansionStatistics{};
+		counts[(unsigned char)symbol] = 1.0;
+		first[(unsigned char)symbol] = 1.0;
+		last[(unsigned char)symbol] = 1.0;
+		emptyProbability = 0.0;
+	}
+
+	// Appends an independent expansion. Pairs across the seam come from our last and its first symbol.
+	void Append(const ExpansionStatistics& next)
+	{
+		for (int c = 0; c < 256; c++)
+		{
+			pairs[c] += next.pairs[c] + last[c] * next.first[c];
+			counts[c] += next.counts[c];
+			first[c] += emptyProbability * next.first[c];
+			last[c] = next.last[c] + next.emptyProbability * last[c];
+		}
+		emptyProbability *= next.emptyProbability;
+	}
+
+	void AddWeighted(const ExpansionStatistics& other, double weight)
+	{
+		for (int c = 0; c < 256; c++)
+		{
+			counts[c] += weight * other.counts[c];
+			first[c] += weight * other.first[c];
+			last[c] += weight * other.last[c];
+			pairs[c] += weight * other.pairs[c];
+		}
+		emptyProbability += weight * other.emptyProbability;
+	}
+};
+
+ProductionEstimate CompiledLSystem::EstimateProduction(int iterations) const
+{
+	// Only variables change between iterations, constants always expand to themselves
+	std::array<int, 256> variableSlots;
+	variableSlots.fill(-1);
+	int variableCount = 0;
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		if (successors[symbol].isVariable)
+		{
+			variableSlots[symbol] = variableCount++;
+		}
+	}
+
+	std::vector<ExpansionStatistics> previous(variableCount);
+	std::vector<ExpansionStatistics> current(variableCount);
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		if (variableSlots[symbol] >= 0) previous[variableSlots[symbol]].SetSymbol(char(symbol));
+	}
+
+	ExpansionStatistics constant;
+	auto statisticsOf = [&](char c) -> const ExpansionStatistics&
+	{
+		int slot = variableSlots[(unsigned char)c];
+		if (slot >= 0) return previous[slot];
+		constant.SetSymbol(c);
+		return constant;
+	};
+
+	ExpansionStatistics sequence;
+	for (int k = 0; k < iterations; k++)
+	{
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			int slot = variableSlots[symbol];
+			if (slot < 0) continue;
+
+			const Successor& successor = successors[symbol];
+			current[slot] = ExpansionStatistics{};
+			current[slot].emptyProbability = 0.0;
+
+			double previousProbability = 0.0;
+			for (uint32_t a = 0; a < successor.alternativeCount; a++)
+			{
+				const Alternative& alternative = alternatives[successor.firstAlternative + a];
+				const char* symbols = SuccessorSymbols(alternative);
+
+				sequence = ExpansionStatistics{};
+				for (uint32_t i = 0; i < alternative.length; i++)
+				{
+					sequence.Append(statisticsOf(symbols[i]));
+				}
+				current[slot].AddWeighted(sequence, alternative.cumulativeProbability - previousProbability);
+				previousProbability = alternative.cumulativeProbability;
+			}
+		}
+		previous.swap(current);
+	}
+
+	sequence = ExpansionStatistics{};
+	for (char c : axiom)
+	{
+		sequence.Append(statisticsOf(c));
+	}
+
+	ProductionEstimate estimate;
+	for (int c = 0; c < 256; c++)
+	{
+		estimate.length += sequence.counts[c];
+		estimate.symbolCounts[c] = sequence.counts[c];
+		estimate.runCounts[c] = sequence.counts[c] - sequence.pairs[c];
+	}
+	return estimate;
+}
+
+int CompiledLSystem::MaxBracketDepth(int iterations) const
+{
+	std::array<BracketProfile, 256> previous;
+	std::array<BracketProfile, 256> current;
+	for (int symbol = 0; symbol < 256; symbol++)
+	{
+		previous[symbol] = BracketProfile::Of(char(symbol));
+	}
+
+	for (int k = 0; k < iterations; k++)
+	{
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			const Successor& successor = successors[symbol];
+			if (!successor.isVariable)
+			{
+				current[symbol] = previous[symbol];
+				continue;
+			}
+
+			// The largest change and the deepest point over all alternatives bound whichever one is chosen
+			for (uint32_t a = 0; a < successor.alternativeCount; a++)
+			{
+				const Alternative& alternative = alternatives[successor.firstAlternative + a];
+				const char* symbols = SuccessorSymbols(alternative);
+
+				BracketProfile sequence;
+				for (uint32_t i = 0; i < alternative.length; i++)
+				{
+					sequence.Append(previous[(unsigned char)symbols[i]]);
+				}
+
+				if (a == 0)
+				{
+					current[symbol] = sequence;
+				}
+				else
+				{
+					current[symbol].net = (sequence.net > current[symbol].net) ? sequence.net : current[symbol].net;
+					current[symbol].peak = (sequence.peak > current[symbol].peak) ? sequence.peak : current[symbol].peak;
+				}
+			}
+		}
+		previous = current;
+	}
+
+	BracketProfile production;
+	for (char c : axiom)
+	{
+		production.Append(previous[(unsigned char)c]);
+	}
+	return (production.peak > INT32_MAX) ? INT32_MAX : int(production.peak);
+}
+
+
+/*
+	LSystemString
+*/
 std::string LSystemString::RunProduction(int iterations)
 {
+	iterations = (iterations < 0) ? 0 : iterations;
+
+	if (productionCache.empty() || cachedAxiom != axiom || cachedRules != productionRules)
+	{
+		ClearCache();
+		cachedAxiom = axiom;
+		cachedRules = productionRules;
+		productionCache.push_back(axiom);
+	}
+
+	if (iterations >= int(productionCache.size()))
+	{
+		CompiledLSystem compiled = Compile();
+		while (iterations >= int(productionCache.size()))
+		{
+			std::string newString;
+			int iteration = int(productionCache.size()) - 1;
+			compiled.Rewrite(productionCache.back(), iteration, newString);
+			productionCache.push_back(std::move(newString));
+		}
+	}
+
+	return productionCache[iterations];
+}
+
+void LSystemString::ClearCache()
+{
+	productionCache.clear();
+	productionCache.shrink_to_fit();
+	cachedAxiom.clear();
+	cachedRules.clear();
+}
+
+std::string LSystemString::RunProductionExact(int iterations) const
+{
+	return Compile().RunProductionExact(iterations);
+}
+
+std::string LSystemString::RunProductionParallel(int iterations, unsigned int threadCount) const
+{
+	return Compile().RunProductionParallel(iterations, threadCount);
+}
+
+uint64_t LSystemString::ProductionLength(int iterations) const
+{
+	return Compile().ProductionLength(iterations);
+}
+
+SymbolLengthTable LSystemString::ComputeLengthTable(int iterations) const
+{
+	return Compile().ComputeLengthTable(iterations);
+}
+
+ProductionEstimate LSystemString::EstimateProduction(int iterations) const
+{
+	return Compile().EstimateProduction(iterations);
+}
+
+int LSystemString::MaxBracketDepth(int iterations) const
+{
+	return Compile().MaxBracketDepth(iterations);
+}
+
+
+/*
+	LSystemStochastic
+*/
+std::string LSystemStochastic::RunProduction(int iterations) const
+{
+	return Compile().RunProduction(iterations);
+}
+
+std::string LSystemStochastic::RunProductionParallel(int iterations, unsigned int threadCount) const
+{
+	return Compile().RunProductionParallel(iterations, threadCount);
+}
+
+ProductionEstimate LSystemStochastic::EstimateProduction(int iterations) const
+{
+	return Compile().EstimateProduction(iterations);
+}
+
+int LSystemStochastic::MaxBracketDepth(int iterations) const
+{
+	return Compile().MaxBracketDepth(iterations);
+}
+
+
+/*
+	BracketIndex
+*/
+void BracketIndex::Build(const std::string& symbols, const std::string& ignoredSymbols)
+{
+	std::array<bool, 256> isIgnored;
+	isIgnored.fill(false);
+	for (char c : ignoredSymbols)
+	{
+		isIgnored[(unsigned char)c] = true;
+	}
+
+	uint32_t size = uint32_t(symbols.size());
+	matchingBracket.assign(size, None);
+	leftNeighbour.assign(size, None);
+	rightNeighbour.assign(size, None);
+
+	std::vector<uint32_t> openBrackets;
+	for (uint32_t i = 0; i < size; i++)
+	{
+		if (symbols[i] == '[')
+		{
+			openBrackets.push_back(i);
+		}
+		else if (symbols[i] == ']' && !openBrackets.empty())
+		{
+			matchingBracket[i] = openBrackets.back();
+			matchingBracket[openBrackets.back()] = i;
+			openBrackets.pop_back();
+		}
+	}
+
+	// The closest context symbol at or before position i, reusing the result of earlier positions.
+	// A complete sub-branch is skipped by jumping to its '[', entering a branch continues before the '['.
+	std::vector<uint32_t> contextAtOrBefore(size, None);
+	for (uint32_t i = 0; i < size; i++)
+	{
+		leftNeighbour[i] = (i > 0) ? contextAtOrBefore[i - 1] : None;
+
+		char c = symbols[i];
+		if (c == ']')
+		{
+			uint32_t open = matchingBracket[i];
+			contextAtOrBefore[i] = (open != None && open > 0) ? contextAtOrBefore[open - 1] : None;
+		}
+		else if (c == '[' || isIgnored[(unsigned char)c])
+		{
+			contextAtOrBefore[i] = leftNeighbour[i];
+		}
+		else
+		{
+			contextAtOrBefore[i] = i;
+		}
+	}
+
+	// The closest context symbol at or after position i on the same branch, built back to front
+	std::vector<uint32_t> contextAtOrAfter(size, None);
+	for (uint32_t i = size; i-- > 0;)
+	{
+		rightNeighbour[i] = (i + 1 < size) ? contextAtOrAfter[i + 1] : None;
+
+		char c = symbols[i];
+		if (c == '[')
+		{
+			uint32_t close = matchingBracket[i];
+			contextAtOrAfter[i] = (close != None && close + 1 < size) ? contextAtOrAfter[close + 1] : None;
+		}
+		else if (c == ']')
+		{
+			contextAtOrAfter[i] = None;
+		}
+		else if (isIgnored[(unsigned char)c])
+		{
+			contextAtOrAfter[i] = rightNeighbour[i];
+		}
+		else
+		{
+			contextAtOrAfter[i] = i;
+		}
+	}
+}
+
+
+/*
+	LSystemContextSensitive
+*/
+std::string LSystemContextSensitive::RunProduction(int iterations) const
+{
+	std::array<const std::vector<Rule>*, 256> rules;
+	rules.fill(nullptr);
+	for (auto& rule : productionRules)
+	{
+		rules[(unsigned char)rule.first] = &rule.second;
+	}
+
 	std::string production = axiom;
+	std::string newString;
+	BracketIndex index;
 
 	while (--iterations >= 0)
 	{
-		std::string newString;
-		for (char c : production)
+		// Every rule reads the previous generation, so the index is built once per pass
+		index.Build(production, ignoredSymbols);
+
+		newString.clear();
+		for (uint32_t i = 0; i < uint32_t(production.size()); i++)
 		{
-			if (productionRules.count(c))
+			char c = production[i];
+			const Rule* match = nullptr;
+			if (const std::vector<Rule>* candidates = rules[(unsigned char)c])
+			{
+				for (const Rule& rule : *candidates)
+				{
+					if (Matches(rule, production, index, i))
+					{
+						match = &rule;
+						break;
+					}
+				}
+			}
+
+			if (match)
 			{
-				newString.append(productionRules[c]);
+				newString.append(match->successor);
 			}
 			else
 			{
 				newString.append(1, c);
 			}
 		}
-		production = newString;
+		production.swap(newString);
 	}
 
 	return production;
 }
 
+bool LSystemContextSensitive::Matches(const Rule& rule, const std::string& symbols, const BracketIndex& index, uint32_t position) const
+{
+	// The left context is compared from its last symbol outwards, towards the root
+	uint32_t neighbour = position;
+	for (size_t i = rule.leftContext.size(); i-- > 0;)
+	{
+		neighbour = index.leftNeighbour[neighbour];
+		if (neighbour == BracketIndex::None || symbols[neighbour] != rule.leftContext[i])
+		{
+			return false;
+		}
+	}
+
+	neighbour = position;
+	for (char c : rule.rightContext)
+	{
+		neighbour = index.rightNeighbour[neighbour];
+		if (neighbour == BracketIndex::None || symbols[neighbour] != c)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*
+	LSystemStringFunctional
+*/
 std::string LSystemStringFunctional::RunProduction(int iterations)
 {
+	std::array<const Rule*, 256> rules = CompileRules();
 	std::string production = axiom;
+	std::string newString;
 
 	while (--iterations >= 0)
 	{
-		std::string newString;
+		newString.clear();
 		for (char c : production)
 		{
-			if (productionRules.count(c))
+			const Rule* rule = rules[(unsigned char)c];
+			if (rule)
 			{
-				newString.append(productionRules[c]());
+				newString.append((*rule)());
 			}
 			else
 			{
 				newString.append(1, c);
 			}
 		}
-		production = newString;
+		production.swap(newString);
 	}
 
 	return production;
 }
+
+std::array<const LSystemStringFunctional::Rule*, 256> LSystemStringFunctional::CompileRules() const
+{
+	std::array<const Rule*, 256> rules;
+	rules.fill(nullptr);
+	for (auto& rule : productionRules)
+	{
+		rules[(unsigned char)rule.first] = &rule.second;
+	}
+	return rules;
+}
\ No newline at end of file
@@ -1,7 +1,189 @@
 #pragma once
 #include <string>
 #include <map>
+#include <vector>
+#include <array>
+#include <cstdint>
 #include <functional>
+#include "../core/randomization.h"
+
+// Number of symbols a character turns into after k iterations, indexed as table[k][unsigned char]
+using SymbolLengthTable = std::vector<std::array<uint64_t, 256>>;
+
+// Size of a production predicted from the rules, nothing is expanded.
+// Exact for deterministic rules, expected values for stochastic ones.
+struct ProductionEstimate
+{
+	double length = 0.0;
+	std::array<double, 256> symbolCounts{};	// how often each symbol appears, indexed by unsigned char
+	std::array<double, 256> runCounts{};	// how many runs of repeated symbols there are, i.e. turtle actions after merging
+
+	double Count(char symbol) const { return symbolCounts[(unsigned char)symbol]; }
+	double Runs(char symbol) const { return runCounts[(unsigned char)symbol]; }
+};
+
+// Nesting of '[' and ']' over a piece of a production, relative to the depth where the piece starts:
+// the depth change from start to end and the deepest point reached in between.
+struct BracketProfile
+{
+	int64_t net = 0;
+	int64_t peak = 0;
+
+	static BracketProfile Of(char symbol)
+	{
+		if (symbol == '[') return BracketProfile{ 1, 1 };
+		if (symbol == ']') return BracketProfile{ -1, 0 };
+		return BracketProfile{};
+	}
+
+	void Append(const BracketProfile& next)
+	{
+		peak = (net + next.peak > peak) ? net + next.peak : peak;
+		net += next.net;
+	}
+};
+
+class LSystemString;
+class LSystemStochastic;
+
+// Frozen copy of an L-system. The std::map is flattened into a dense table indexed by unsigned char
+// and all successors are stored back to back in one buffer, so looking up a symbol is a single array access.
+class CompiledLSystem
+{
+public:
+	struct Alternative
+	{
+		uint32_t offset = 0;
+		uint32_t length = 0;
+		double cumulativeProbability = 1.0;
+	};
+
+	struct Successor
+	{
+		uint32_t firstAlternative = 0;
+		uint32_t alternativeCount = 0;
+		bool isVariable = false;
+	};
+
+	std::string axiom = "";
+	uint64_t seed = 0;
+	bool isDeterministic = true; // true when every variable has exactly one successor
+	std::string successorSymbols;
+	std::vector<Alternative> alternatives;
+	std::array<Successor, 256> successors;
+
+	CompiledLSystem() = default;
+	CompiledLSystem(const LSystemString& lsystem);
+	CompiledLSystem(const LSystemStochastic& lsystem);
+	~CompiledLSystem() = default;
+
+	const Successor& Find(char symbol) const
+	{
+		return successors[(unsigned char)symbol];
+	}
+
+	// Picks the successor for the ordinal'th variable of the string that the given iteration rewrites.
+	// The choice is a pure function of (seed, iteration, ordinal), so every expansion method agrees on it.
+	const Alternative& Choose(const Successor& successor, int iteration, uint64_t ordinal) const
+	{
+		const Alternative* alternative = &alternatives[successor.firstAlternative];
+		if (successor.alternativeCount > 1)
+		{
+			double u = UnitDouble(HashCounter(seed, uint64_t(iteration), ordinal));
+			const Alternative* last = alternative + (successor.alternativeCount - 1);
+			while (alternative != last && u >= alternative->cumulativeProbability)
+			{
+				alternative++;
+			}
+		}
+		return *alternative;
+	}
+
+	const char* SuccessorSymbols(const Alternative& alternative) const
+	{
+		return successorSymbols.data() + alternative.offset;
+	}
+
+	std::string RunProduction(int iterations = 1) const;
+	std::string RunProductionExact(int iterations = 1) const;
+	std::string RunProductionParallel(int iterations = 1, unsigned int threadCount = 0) const;
+	uint64_t ProductionLength(int iterations = 1) const;
+
+	// One rewrite pass over production, which is the result of the given number of iterations
+	void Rewrite(const std::string& production, int iteration, std::string& output) const;
+
+	// Exact for deterministic rules. With several alternatives the longest one is counted, which gives an upper bound.
+	SymbolLengthTable ComputeLengthTable(int iterations) const;
+
+	// Pushes per-symbol statistics through the rules once per iteration, the cost grows with
+	// iterations * rule length instead of with the production. Stochastic choices are treated as independent draws.
+	ProductionEstimate EstimateProduction(int iterations = 1) const;
+
+	// Deepest '[' nesting of the production, i.e. how many turtle states are pushed at most. Computed from
+	// the bracket profile of every symbol per iteration without expanding anything. Exact for deterministic
+	// rules, with several alternatives the deepest one is taken, which gives an upper bound.
+	int MaxBracketDepth(int iterations = 1) const;
+
+	template<class SymbolCallback>
+	void StreamProduction(int iterations, SymbolCallback&& onSymbol) const
+	{
+		struct Cursor
+		{
+			const char* next;
+			const char* end;
+			int depth;
+		};
+
+		size_t maxDepth = size_t(iterations > 0 ? iterations : 0) + 1;
+
+		// Variables are visited in string order on every level, so counting them per level gives the same
+		// ordinals as a full rewrite pass would.
+		std::vector<uint64_t> variableOrdinals(maxDepth, 0);
+
+		std::vector<Cursor> stack;
+		stack.reserve(maxDepth);
+		stack.push_back(Cursor{ axiom.data(), axiom.data() + axiom.size(), 0 });
+
+		while (!stack.empty())
+		{
+			Cursor& top = stack.back();
+			if (top.next == top.end)
+			{
+				stack.pop_back();
+				continue;
+			}
+
+			char c = *top.next++;
+			int depth = top.depth;
+			const Successor& successor = Find(c);
+			if (successor.isVariable && depth < iterations)
+			{
+				const Alternative& alternative = Choose(successor, depth, variableOrdinals[depth]++);
+				const char* symbols = SuccessorSymbols(alternative);
+				if (depth + 1 == iterations)
+				{
+					// Last iteration, the successor is already final output
+					for (uint32_t i = 0; i < alternative.length; i++)
+					{
+						onSymbol(symbols[i]);
+					}
+				}
+				else
+				{
+					stack.push_back(Cursor{ symbols, symbols + alternative.length, depth + 1 });
+				}
+				continue;
+			}
+
+			onSymbol(c);
+		}
+	}
+
+protected:
+	// Alternatives of one symbol must be added one after another, NormalizeProbabilities finishes the table
+	void AddAlternative(char symbol, const std::string& successor, float weight);
+	void NormalizeProbabilities();
+};
 
 class LSystemString
 {
@@ -12,17 +194,179 @@ public:
 	LSystemString() = default;
 	~LSystemString() = default;
 
+	// Freezes the rules into a lookup table. The production methods below compile on every call,
+	// keep the result around when the same rules are expanded many times.
+	CompiledLSystem Compile() const
+	{
+		return CompiledLSystem{ *this };
+	}
+
+	// Every iteration that has been expanded is kept, so asking for one more iteration than before costs a single
+	// rewrite pass and asking for fewer is a copy. The cache is dropped when the axiom or the rules change.
 	std::string RunProduction(int iterations = 1);
+	void ClearCache();
+
+	// Same result as RunProduction, but the final length is computed up front from a length table
+	// and the string is written once into a single allocation. No intermediate strings are built.
+	std::string RunProductionExact(int iterations = 1) const;
+
+	// Same result as RunProduction, but every rewrite pass is split into chunks that run on separate threads.
+	// Each chunk measures its output, a prefix sum over those lengths gives the write offsets, and all
+	// chunks then write straight into one shared buffer. Small passes are rewritten on the calling thread.
+	std::string RunProductionParallel(int iterations = 1, unsigned int threadCount = 0) const;
+
+	// Symbol count of the final production, computed without expanding anything. (saturates at UINT64_MAX)
+	uint64_t ProductionLength(int iterations = 1) const;
+	SymbolLengthTable ComputeLengthTable(int iterations) const;
+	ProductionEstimate EstimateProduction(int iterations = 1) const;
+	int MaxBracketDepth(int iterations = 1) const;
+
+	// Walks the derivation tree depth-first and hands each final symbol to onSymbol, in the same order as RunProduction.
+	// Nothing but a stack of rule cursors is stored, so memory grows with the iteration count instead of the output length.
+	template<class SymbolCallback>
+	void StreamProduction(int iterations, SymbolCallback&& onSymbol) const
+	{
+		Compile().StreamProduction(iterations, std::forward<SymbolCallback>(onSymbol));
+	}
+
+protected:
+	std::vector<std::string> productionCache; // productionCache[k] is the production after k iterations
+	std::string cachedAxiom = "";
+	std::map<char, std::string> cachedRules;
+};
+
+// L-system where every variable has a list of weighted successors. The successor is picked by hashing
+// (seed, iteration, position of the variable), so no random generator state is shared between symbols.
+// The result depends only on the seed, nothing is allocated per symbol and it expands in parallel.
+class LSystemStochastic
+{
+public:
+	struct Alternative
+	{
+		std::string successor;
+		float weight = 1.0f;
+	};
+
+	std::string axiom = "";
+	uint64_t seed = 0;
+	std::map<char, std::vector<Alternative>> productionRules; // any symbol assigned here becomes a variable
+
+	LSystemStochastic() = default;
+	~LSystemStochastic() = default;
+
+	CompiledLSystem Compile() const
+	{
+		return CompiledLSystem{ *this };
+	}
+
+	std::string RunProduction(int iterations = 1) const;
+	std::string RunProductionParallel(int iterations = 1, unsigned int threadCount = 0) const;
+
+	// Expected symbol and run counts over all seeds
+	ProductionEstimate EstimateProduction(int iterations = 1) const;
+	int MaxBracketDepth(int iterations = 1) const; // deepest nesting over all seeds
+
+	template<class SymbolCallback>
+	void StreamProduction(int iterations, SymbolCallback&& onSymbol) const
+	{
+		Compile().StreamProduction(iterations, std::forward<SymbolCallback>(onSymbol));
+	}
+};
+
+// Neighbour positions for every symbol of a bracketed string, built in two linear passes.
+// The left neighbour is the previous symbol on the path towards the root, so it jumps out of '[' to the
+// symbol before the branch and over complete [...] sub-branches. The right neighbour is the next symbol
+// on the same branch, skipping complete sub-branches and stopping at ']'.
+struct BracketIndex
+{
+	static constexpr uint32_t None = UINT32_MAX;
+
+	std::vector<uint32_t> matchingBracket; // position of the matching bracket for '[' and ']', None otherwise
+	std::vector<uint32_t> leftNeighbour;
+	std::vector<uint32_t> rightNeighbour;
+
+	// Symbols in ignoredSymbols are never a neighbour, e.g. "+-" so rotations do not break a context
+	void Build(const std::string& symbols, const std::string& ignoredSymbols = "");
+};
+
+// L-system where a rule can require the symbols before and after the predecessor, written as
+// leftContext < predecessor > rightContext. Contexts follow the branch structure (see BracketIndex),
+// so signals can travel up and down a plant. Each neighbour is found in constant time.
+class LSystemContextSensitive
+{
+public:
+	struct Rule
+	{
+		std::string leftContext = "";	// empty matches anything, otherwise the symbols leading up to the predecessor
+		std::string rightContext = "";	// empty matches anything, otherwise the symbols following the predecessor
+		std::string successor = "";
+	};
+
+	std::string axiom = "";
+	std::string ignoredSymbols = "";
+	std::map<char, std::vector<Rule>> productionRules; // rules of a symbol are tried in order, the first match is used
+
+	LSystemContextSensitive() = default;
+	~LSystemContextSensitive() = default;
+
+	std::string RunProduction(int iterations = 1) const;
+
+	bool Matches(const Rule& rule, const std::string& symbols, const BracketIndex& index, uint32_t position) const;
 };
 
 class LSystemStringFunctional
 {
 public:
+	using Rule = std::function<std::string()>;
+
 	std::string axiom = "";
-	std::map<char, std::function<std::string()>> productionRules; // any symbol assigned here becomes a variable
+	std::map<char, Rule> productionRules; // any symbol assigned here becomes a variable
 
 	LSystemStringFunctional() = default;
 	~LSystemStringFunctional() = default;
 
 	std::string RunProduction(int iterations = 1);
-};
+
+	// Depth-first version of RunProduction, see LSystemString::StreamProduction.
+	// The rules are evaluated in derivation order instead of one full iteration at a time.
+	template<class SymbolCallback>
+	void StreamProduction(int iterations, SymbolCallback&& onSymbol) const
+	{
+		struct Cursor
+		{
+			std::string symbols;
+			size_t next;
+			int depth;
+		};
+
+		std::array<const Rule*, 256> rules = CompileRules();
+
+		std::vector<Cursor> stack;
+		stack.reserve(size_t(iterations > 0 ? iterations : 0) + 1);
+		stack.push_back(Cursor{ axiom, 0, 0 });
+
+		while (!stack.empty())
+		{
+			Cursor& top = stack.back();
+			if (top.next == top.symbols.size())
+			{
+				stack.pop_back();
+				continue;
+			}
+
+			char c = top.symbols[top.next++];
+			int depth = top.depth;
+			const Rule* rule = rules[(unsigned char)c];
+			if (rule && depth < iterations)
+			{
+				stack.push_back(Cursor{ (*rule)(), 0, depth + 1 });
+				continue;
+			}
+
+			onSymbol(c);
+		}
+	}
+
+protected:
+	std::array<const Rule*, 256> CompileRules() const;
+};
\ No newline at end of file
@@ -0,0 +1,157 @@
+#include "parametric.h"
+#include <algorithm>
+
+// Deepest '[' nesting of a module string
+int MeasureBracketDepth(const std::vector<char>& symbols)
+{
+	int depth = 0;
+	int maxDepth = 0;
+	for (char c : symbols)
+	{
+		depth += (c == '[') ? 1 : (c == ']') ? -1 : 0;
+		maxDepth = (depth > maxDepth) ? depth : maxDepth;
+	}
+	return maxDepth;
+}
+
+void ParametricLSystem::Expand(int iterations)
+{
+	if (productionCache.empty() || cachedAxiom != axiom)
+	{
+		ClearCache();
+		cachedAxiom = axiom;
+		productionCache.push_back(axiom);
+		bracketDepths.push_back(MeasureBracketDepth(axiom.symbols));
+	}
+
+	if (iterations >= int(productionCache.size()))
+	{
+		std::array<const Rule*, 256> rules;
+		rules.fill(nullptr);
+		for (auto& rule : productionRules)
+		{
+			if (rule.second)
+			{
+				rules[(unsigned char)rule.first] = &rule.second;
+			}
+		}
+
+		while (iterations >= int(productionCache.size()))
+		{
+			const ModuleStream& previous = productionCache.back();
+			ModuleStream newStream;
+			for (size_t i = 0; i < previous.Size(); i++)
+			{
+				char symbol = previous.symbols[i];
+				const float* parameters = previous.Parameters(i);
+				int parameterCount = previous.ParameterCount(i);
+
+				const Rule* rule = rules[(unsigned char)symbol];
+				if (rule)
+				{
+					(*rule)(parameters, parameterCount, newStream);
+				}
+				else
+				{
+					newStream.Add(symbol, parameters, parameterCount);
+				}
+			}
+			bracketDepths.push_back(MeasureBracketDepth(newStream.symbols));
+			productionCache.push_back(std::move(newStream));
+		}
+	}
+}
+
+void ParametricLSystem::RunProduction(int iterations, ModuleStream& production)
+{
+	iterations = (iterations < 0) ? 0 : iterations;
+	Expand(iterations);
+
+	if (additiveSymbols.empty())
+	{
+		production = productionCache[iterations];
+	}
+	else
+	{
+		MergeAdditiveModules(productionCache[iterations], production);
+	}
+}
+
+ModuleStream ParametricLSystem::RunProduction(int iterations)
+{
+	ModuleStream production;
+	RunProduction(iterations, production);
+	return production;
+}
+
+int ParametricLSystem::MaxBracketDepth(int iterations)
+{
+	iterations = (iterations < 0) ? 0 : iterations;
+	Expand(iterations);
+	return bracketDepths[iterations];
+}
+
+void ParametricLSystem::ClearCache()
+{
+	productionCache.clear();
+	productionCache.shrink_to_fit();
+	bracketDepths.clear();
+	cachedAxiom.Clear();
+}
+
+void ParametricLSystem::TrimCache(int iterations)
+{
+	size_t keep = size_t((iterations < 0) ? 0 : iterations) + 1;
+	if (productionCache.size() > keep)
+	{
+		productionCache.resize(keep);
+		bracketDepths.resize(keep);
+	}
+}
+
+size_t ParametricLSystem::CacheBytes() const
+{
+	size_t bytes = 0;
+	for (const ModuleStream& production : productionCache)
+	{
+		bytes += production.symbols.capacity() * sizeof(char)
+			+ production.parameterOffsets.capacity() * sizeof(uint32_t)
+			+ production.parameters.capacity() * sizeof(float);
+	}
+	return bytes;
+}
+
+void ParametricLSystem::MergeAdditiveModules(const ModuleStream& input, ModuleStream& output) const
+{
+	std::array<bool, 256> isAdditive;
+	isAdditive.fill(false);
+	for (char c : additiveSymbols)
+	{
+		isAdditive[(unsigned char)c] = true;
+	}
+
+	output.Clear();
+	for (size_t i = 0; i < input.Size(); i++)
+	{
+		char symbol = input.symbols[i];
+		const float* parameters = input.Parameters(i);
+		int parameterCount = input.ParameterCount(i);
+
+		size_t last = output.Size() - 1;
+		bool canMerge = isAdditive[(unsigned char)symbol]
+			&& output.Size() > 0
+			&& parameterCount > 0
+			&& output.symbols[last] == symbol
+			&& output.ParameterCount(last) == parameterCount
+			&& std::equal(parameters + 1, parameters + parameterCount, output.Parameters(last) + 1);
+
+		if (canMerge)
+		{
+			output.parameters[output.parameterOffsets[last]] += parameters[0];
+		}
+		else
+		{
+			output.Add(symbol, parameters, parameterCount);
+		}
+	}
+}
\ No newline at end of file
@@ -0,0 +1,101 @@
+#pragma once
+#include <string>
+#include <map>
+#include <vector>
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+
+// A string of parametric L-system modules, e.g. A(length, width), stored as a struct of arrays.
+// Module i has the symbol symbols[i] and the parameters [parameterOffsets[i], parameterOffsets[i+1]).
+struct ModuleStream
+{
+	std::vector<char> symbols;
+	std::vector<uint32_t> parameterOffsets = { 0 };
+	std::vector<float> parameters;
+
+	size_t Size() const
+	{
+		return symbols.size();
+	}
+
+	const float* Parameters(size_t module) const
+	{
+		return parameters.data() + parameterOffsets[module];
+	}
+
+	int ParameterCount(size_t module) const
+	{
+		return int(parameterOffsets[module + 1] - parameterOffsets[module]);
+	}
+
+	void Clear()
+	{
+		symbols.clear();
+		parameterOffsets.resize(1);
+		parameters.clear();
+	}
+
+	void Add(char symbol, const float* moduleParameters, int count)
+	{
+		symbols.push_back(symbol);
+		parameters.insert(parameters.end(), moduleParameters, moduleParameters + count);
+		parameterOffsets.push_back(uint32_t(parameters.size()));
+	}
+
+	void Add(char symbol, std::initializer_list<float> moduleParameters = {})
+	{
+		Add(symbol, moduleParameters.begin(), int(moduleParameters.size()));
+	}
+
+	bool operator==(const ModuleStream& other) const
+	{
+		return symbols == other.symbols && parameterOffsets == other.parameterOffsets && parameters == other.parameters;
+	}
+
+	bool operator!=(const ModuleStream& other) const
+	{
+		return !(*this == other);
+	}
+};
+
+// L-system where every module carries float parameters, so continuous state (lengths, scales, repetition counts)
+// lives in the modules instead of being encoded as runs of extra characters. Rules read the parameters of the
+// module they replace and write the successor modules.
+class ParametricLSystem
+{
+public:
+	using Rule = std::function<void(const float* parameters, int parameterCount, ModuleStream& successor)>;
+
+	ModuleStream axiom;
+	std::map<char, Rule> productionRules; // any symbol assigned here becomes a variable
+
+	// Neighbouring modules with one of these symbols are merged after the last iteration when all their parameters
+	// except the first are equal. The first parameters are added. (e.g. A(1,s)A(2,s) becomes A(3,s))
+	std::string additiveSymbols = "";
+
+	ParametricLSystem() = default;
+	~ParametricLSystem() = default;
+
+	// Every iteration that has been expanded is kept, so asking for one more iteration than before costs a single
+	// rewrite pass and asking for fewer is a copy. Rules are functions and can not be compared,
+	// call ClearCache after changing them. A changed axiom is detected.
+	void RunProduction(int iterations, ModuleStream& production);
+	ModuleStream RunProduction(int iterations = 1);
+	void ClearCache();
+	void TrimCache(int iterations); // drops the cached iterations above this one, e.g. after stepping down
+	size_t CacheBytes() const;
+
+	// Deepest '[' nesting of the production, measured once per iteration while it is expanded
+	int MaxBracketDepth(int iterations = 1);
+
+protected:
+	std::vector<ModuleStream> productionCache; // productionCache[k] is the production after k iterations, before merging
+	std::vector<int> bracketDepths;				// bracketDepths[k] belongs to productionCache[k]
+	ModuleStream cachedAxiom;
+
+	void Expand(int iterations); // fills the cache up to the given iteration
+
+	void MergeAdditiveModules(const ModuleStream& input, ModuleStream& output) const;
+};
\ No newline at end of file
@@ -2,7 +2,8 @@
 #include "../opengl/canvas.h"
 #include "../core/math.h"
 #include <map>
-#include <stack>
+#include <array>
+#include <vector>
 #include <functional>
 
 template<class OptionalState = int>
@@ -22,44 +23,106 @@ protected:
 public:
 	TurtleState state;
 
-	std::stack<TurtleState> turtleStack;
-	std::map<char, std::function<void(Turtle2D&, Canvas2D&)>> actions;
+	using Action = std::function<void(Turtle2D&)>;
+
+	std::vector<TurtleState> turtleStack; // kept between drawings, see ReserveStates
+	std::vector<LineSegment2D> segments;  // lines emitted by the actions, rasterized in one batch after the run
+	std::map<char, Action> actions;
+	std::array<Action*, 256> actionTable{}; // actions indexed by unsigned char, rebuilt by CompileActions() before each drawing
 
 	Turtle2D() = default;
 	~Turtle2D() = default;
 
 	void Clear()
 	{
-		turtleStack = std::stack<TurtleState>();
+		turtleStack.clear();
+		segments.clear();
+	}
+
+	// Sized from the bracket depth of the L-system, so pushing never allocates
+	void ReserveStates(size_t maxBracketDepth)
+	{
+		turtleStack.reserve(maxBracketDepth);
 	}
 
-	void Draw(Canvas2D& canvas, std::string& symbols, glm::fvec2 startPosition, float startAngle)
+	// Runs the symbols into the segment buffer without drawing anything
+	void Run(const std::string& symbols, glm::fvec2 startPosition, float startAngle)
 	{
-		if (turtleStack.size() != 0)
+		Clear();
+		CompileActions();
+		state.position = startPosition;
+		state.angle = startAngle;
+
+		for (char c : symbols)
 		{
-			Clear();
+			RunAction(c);
 		}
+	}
+
+	// Runs the symbols as the L-system produces them, so the full symbol string is never stored.
+	template<class LSystem>
+	void Run(const LSystem& lsystem, int iterations, glm::fvec2 startPosition, float startAngle)
+	{
+		Clear();
+		ReserveStates(size_t(lsystem.MaxBracketDepth(iterations)));
+		CompileActions();
 		state.position = startPosition;
 		state.angle = startAngle;
 
-		for (char& c : symbols)
+		lsystem.StreamProduction(iterations, [this](char c)
+		{
+			RunAction(c);
+		});
+	}
+
+	void Draw(Canvas2D& canvas, const std::string& symbols, glm::fvec2 startPosition, float startAngle)
+	{
+		Run(symbols, startPosition, startAngle);
+		canvas.DrawLines(segments);
+	}
+
+	template<class LSystem>
+	void Draw(Canvas2D& canvas, const LSystem& lsystem, int iterations, glm::fvec2 startPosition, float startAngle)
+	{
+		Run(lsystem, iterations, startPosition, startAngle);
+		canvas.DrawLines(segments);
+	}
+
+	void CompileActions()
+	{
+		actionTable.fill(nullptr);
+		for (auto& action : actions)
 		{
-			if (actions.count(c))
+			if (action.second)
 			{
-				actions[c](*this, canvas);
+				actionTable[(unsigned char)action.first] = &action.second;
 			}
 		}
 	}
 
+	void RunAction(char symbol)
+	{
+		Action* action = actionTable[(unsigned char)symbol];
+		if (action)
+		{
+			(*action)(*this);
+		}
+	}
+
+	void AddSegment(glm::fvec2 start, glm::fvec2 end, const Color& color)
+	{
+		segments.push_back(LineSegment2D{ start, end, color });
+	}
+
 	void PushState()
 	{
-		turtleStack.push(state);
+		turtleStack.push_back(state);
 	}
 
 	void PopState()
 	{
-		state = turtleStack.top();
-		turtleStack.pop();
+		state = turtleStack.back();
+		turtleStack.pop_back();
 	}
 
 	glm::fvec2 GetDirection()
@@ -1,9 +1,16 @@
 #pragma once
 #include "../opengl/mesh.h"
 #include "../core/math.h"
+#include "../core/randomization.h"
+#include "../core/threads.h"
+#include "parametric.h"
 #include <map>
-#include <stack>
+#include <array>
+#include <vector>
+#include <cstdint>
 #include <functional>
+#include <atomic>
+#include <thread>
 
 template<class OptionalState = int>
 struct TurtleTransform
@@ -24,102 +31,234 @@ struct TurtleTransform
 template<class OptionalState = int>
 struct Bone
 {
-	using TBone = Bone<OptionalState>;
+	static constexpr uint32_t None = UINT32_MAX;
 
-	TBone* parent = nullptr;
-	TBone* firstChild = nullptr;
-	TBone* lastChild = nullptr;
-	TBone* previousSibling = nullptr;
-	TBone* nextSibling = nullptr;
+	// Links are indices into the BonePool that owns the bone, None when there is no such bone
+	uint32_t parent = None;
+	uint32_t firstChild = None;
+	uint32_t lastChild = None;
+	uint32_t previousSibling = None;
+	uint32_t nextSibling = None;
 
 	TurtleTransform<OptionalState> transform;
 	float length = 0.0f;
 	int nodeDepth = 1; // distance from root bone in the node tree
 
-	Bone() = default;
-	~Bone()
+	glm::fvec3 tipPosition() const
 	{
-		Clear();
+		return transform.position + transform.forward*length;
 	}
+};
 
-	glm::fvec3 tipPosition()
+// Every bone of a skeleton in one contiguous array. Bones are appended in the order the turtle creates them and
+// a new bone is always a child of the active bone, so the array is a pre-order walk of the tree (parents before
+// children, siblings in creation order). Traversal is a loop over the array and freeing the skeleton is a single
+// clear, nothing recurses. Pointers to bones stay valid until the next bone is added.
+template<class OptionalState = int>
+class BonePool
+{
+public:
+	using TBone = Bone<OptionalState>;
+
+	std::vector<TBone> storage;
+
+	size_t Size() const
 	{
-		return transform.position + transform.forward*length;
+		return storage.size();
 	}
 
-	void Clear()
+	bool Empty() const
 	{
-		parent = nullptr;
-		transform.Clear();
-		length = 0.0f;
+		return storage.empty();
+	}
 
-		if (firstChild)
-		{
-			delete firstChild;
-			firstChild = nullptr;
-		}
+	TBone& operator[](uint32_t index)
+	{
+		return storage[index];
+	}
 
-		if (nextSibling)
-		{
-			delete nextSibling;
-			nextSibling = nullptr;
-		}
+	const TBone& operator[](uint32_t index) const
+	{
+		return storage[index];
+	}
+
+	TBone* Get(uint32_t index)
+	{
+		return (index == TBone::None) ? nullptr : &storage[index];
 	}
 
-	TBone* NewChild()
+	TBone* Root()
 	{
-		TBone* newChild = new TBone();
-		if (!firstChild)
+		return storage.empty() ? nullptr : storage.data();
+	}
+
+	TBone* Parent(const TBone& bone)          { return Get(bone.parent); }
+	TBone* FirstChild(const TBone& bone)      { return Get(bone.firstChild); }
+	TBone* LastChild(const TBone& bone)       { return Get(bone.lastChild); }
+	TBone* PreviousSibling(const TBone& bone) { return Get(bone.previousSibling); }
+	TBone* NextSibling(const TBone& bone)     { return Get(bone.nextSibling); }
+
+	uint32_t IndexOf(const TBone& bone) const
+	{
+		return uint32_t(&bone - storage.data());
+	}
+
+	uint32_t NewRoot()
+	{
+		storage.emplace_back();
+		return uint32_t(storage.size() - 1);
+	}
+
+	uint32_t NewChild(uint32_t parentIndex)
+	{
+		uint32_t index = uint32_t(storage.size());
+		storage.emplace_back();
+
+		TBone& parent = storage[parentIndex];
+		TBone& newChild = storage[index];
+		if (parent.firstChild == TBone::None)
 		{
-			firstChild = newChild;
-			lastChild = newChild;
+			parent.firstChild = index;
 		}
 		else
 		{
-			newChild->previousSibling = lastChild;
-			lastChild->nextSibling = newChild;
-			lastChild = newChild;
+			newChild.previousSibling = parent.lastChild;
+			storage[parent.lastChild].nextSibling = index;
 		}
+		parent.lastChild = index;
+
+		newChild.parent = parentIndex;
+		newChild.transform.position = parent.tipPosition();
+		newChild.nodeDepth = parent.nodeDepth + 1;
 
-		newChild->parent = this;
-		newChild->transform.position = this->tipPosition();
-		newChild->nodeDepth = this->nodeDepth + 1;
+		return index;
+	}
 
-		return newChild;
+	// Keeps the capacity, so the next skeleton of a similar size does not allocate
+	void Clear()
+	{
+		storage.clear();
 	}
 
-	void DebugPrint(int depth = 0)
+	void Release()
 	{
-		for (int i = 0; i < depth; ++i)
+		storage.clear();
+		storage.shrink_to_fit();
+	}
+
+	// Visits the storage in pre-order
+	template<class Callback>
+	void ForEach(Callback&& callback)
+	{
+		for (TBone& bone : storage)
 		{
-			printf("  ");
+			callback(&bone);
 		}
+	}
+
+	void DebugPrint() const
+	{
+		for (const TBone& bone : storage)
+		{
+			for (int i = 1; i < bone.nodeDepth; ++i)
+			{
+				printf("  ");
+			}
 
-		printf("%d\n", nodeDepth);
+			printf("%d\n", bone.nodeDepth);
+		}
+	}
+};
 
-		if (firstChild)
+// Finalized skeleton, one array per bone attribute in pre-order (the BonePool order). The subtree of bone i is
+// [i, subtreeEnd[i]) and its children are found by jumping from i + 1 over each child's subtree, so meshing,
+// leaf placement and debug lines stream through memory instead of chasing links.
+struct FlatSkeleton
+{
+	static constexpr uint32_t None = UINT32_MAX;
+
+	std::vector<glm::fvec3> positions;
+	std::vector<glm::fvec3> forwards;
+	std::vector<glm::fvec3> ups;
+	std::vector<float> lengths;
+	std::vector<int> depths;
+	std::vector<uint32_t> parents;
+	std::vector<uint32_t> subtreeEnds;
+
+	size_t Size() const
+	{
+		return positions.size();
+	}
+
+	glm::fvec3 TipPosition(uint32_t bone) const
+	{
+		return positions[bone] + forwards[bone]*lengths[bone];
+	}
+
+	void Clear()
+	{
+		positions.clear();
+		forwards.clear();
+		ups.clear();
+		lengths.clear();
+		depths.clear();
+		parents.clear();
+		subtreeEnds.clear();
+	}
+
+	template<class OptionalState>
+	void Build(const BonePool<OptionalState>& pool)
+	{
+		const auto& bones = pool.storage;
+		size_t size = bones.size();
+		positions.resize(size);
+		forwards.resize(size);
+		ups.resize(size);
+		lengths.resize(size);
+		depths.resize(size);
+		parents.resize(size);
+		subtreeEnds.resize(size);
+
+		for (size_t i = 0; i < size; i++)
 		{
-			firstChild->DebugPrint(depth+1);
+			const auto& bone = bones[i];
+			positions[i] = bone.transform.position;
+			forwards[i] = bone.transform.forward;
+			ups[i] = bone.transform.up;
+			lengths[i] = bone.length;
+			depths[i] = bone.nodeDepth;
+			parents[i] = bone.parent;
+			subtreeEnds[i] = uint32_t(i + 1);
 		}
 
-		if (nextSibling)
+		// Children come after their parents, so one backwards pass carries every subtree end up to its root
+		for (size_t i = size; i-- > 1;)
 		{
-			nextSibling->DebugPrint(depth);
+			uint32_t parent = parents[i];
+			if (parent != None && subtreeEnds[i] > subtreeEnds[parent])
+			{
+				subtreeEnds[parent] = subtreeEnds[i];
+			}
 		}
 	}
 
-	void ForEach(std::function<void(TBone*)>& callback)
+	// Calls callback(child) for every direct child of the bone
+	template<class Callback>
+	void ForEachChild(uint32_t bone, Callback&& callback) const
 	{
-		callback(this);
-
-		if (firstChild)
+		for (uint32_t child = bone + 1; child < subtreeEnds[bone]; child = subtreeEnds[child])
 		{
-			firstChild->ForEach(callback);
+			callback(child);
 		}
+	}
 
-		if (nextSibling)
+	void ToGLLines(GLLine& lines, glm::fvec4 boneColor, glm::fvec4 normalColor, float normalLength = 0.2f) const
+	{
+		size_t size = Size();
+		for (size_t i = 0; i < size; i++)
 		{
-			nextSibling->ForEach(callback);
+			lines.AddLine(positions[i], positions[i] + forwards[i]*lengths[i], boneColor);
+			lines.AddLine(positions[i], positions[i] + ups[i]*normalLength, normalColor);
 		}
 	}
 };
@@ -132,16 +271,34 @@ protected:
 	using TTransform = TurtleTransform<OptionalState>;
 
 public:
-	std::map<char, std::function<void(Turtle3D&, int)>> actions;
+	using Action = std::function<void(Turtle3D&, int)>;
+	std::map<char, Action> actions;
+	std::array<Action*, 256> actionTable{}; // actions indexed by unsigned char, rebuilt by CompileActions() before each skeleton
+
+	// Actions for parametric modules, they receive the module parameters instead of a repetition count
+	using ModuleAction = std::function<void(Turtle3D&, const float* parameters, int parameterCount)>;
+	std::map<char, ModuleAction> moduleActions;
+	std::array<ModuleAction*, 256> moduleActionTable{};
+
+	// Transform and active bone saved by PushState, both on one stack. The storage is kept between runs
+	// and ReserveStates sizes it from the bracket depth of the L-system, so pushing never allocates.
+	struct SavedState
+	{
+		TTransform transform;
+		uint32_t activeBone;
+	};
 
 	TTransform transform;
-	std::stack<TTransform> transformStack;
-	std::stack<TurtleBone*> branchStack;
-	TurtleBone* activeBone = nullptr;
-	TurtleBone* rootBone = nullptr;
+	std::vector<SavedState> stateStack;
+	size_t stateCount = 0; // used entries of stateStack, the vector itself only grows
+	BonePool<OptionalState> bones;
+	uint32_t activeBone = TurtleBone::None; // index in bones
 
 	int boneCount = 0;
 
+	static constexpr int OrthonormalizeInterval = 64;
+	int rotationsSinceOrthonormalize = 0;
+
 	Turtle3D()
 	{
 		Clear();
@@ -153,19 +310,34 @@ public:
 	{
 		transform.Clear();
 		boneCount = 0;
-		if (rootBone)
+		rotationsSinceOrthonormalize = 0;
+		bones.Clear();
+		activeBone = TurtleBone::None;
+		stateCount = 0;
+	}
+
+	void ReserveStates(size_t maxBracketDepth)
+	{
+		if (stateStack.size() < maxBracketDepth)
 		{
-			delete rootBone;
-			rootBone = nullptr;
-			activeBone = nullptr;
+			stateStack.resize(maxBracketDepth);
 		}
-		transformStack = std::stack<TTransform>();
-		branchStack = std::stack<TurtleBone*>();
+	}
+
+	TurtleBone* RootBone()
+	{
+		return bones.Root();
+	}
+
+	TurtleBone* ActiveBone()
+	{
+		return bones.Get(activeBone);
 	}
 
 	void GenerateSkeleton(std::string& symbols, TTransform startTransform = TTransform{})
 	{
 		Clear();
+		CompileActions();
 		transform = std::move(startTransform);
 
 		size_t size = symbols.size();
@@ -178,48 +350,344 @@ public:
 				i++;
 			}
 
-			if (actions.count(symbols[i]))
+			RunAction(symbols[i], repetitionCounter);
+		}
+	}
+
+	// Interprets the symbols as the L-system produces them, so the full symbol string is never stored.
+	// Runs of the same symbol are merged into one action call just like the string version.
+	// Works with anything that has StreamProduction and MaxBracketDepth, including a prebuilt DerivationGraph.
+	template<class LSystem>
+	void GenerateSkeleton(const LSystem& lsystem, int iterations, TTransform startTransform = TTransform{})
+	{
+		Clear();
+		ReserveStates(size_t(lsystem.MaxBracketDepth(iterations)));
+		CompileActions();
+		transform = std::move(startTransform);
+
+		char pendingSymbol = 0;
+		int repetitionCounter = 0;
+		lsystem.StreamProduction(iterations, [this, &pendingSymbol, &repetitionCounter](char c)
+		{
+			if (repetitionCounter > 0 && c == pendingSymbol)
+			{
+				repetitionCounter++;
+				return;
+			}
+
+			RunAction(pendingSymbol, repetitionCounter);
+			pendingSymbol = c;
+			repetitionCounter = 1;
+		});
+		RunAction(pendingSymbol, repetitionCounter);
+	}
+
+	// Interprets a parametric module stream directly, one action call per module.
+	void GenerateSkeleton(const ModuleStream& modules, TTransform startTransform = TTransform{})
+	{
+		Clear();
+		CompileActions();
+		transform = std::move(startTransform);
+
+		size_t size = modules.Size();
+		for (size_t i = 0; i < size; i++)
+		{
+			ModuleAction* action = moduleActionTable[(unsigned char)modules.symbols[i]];
+			if (action)
 			{
-				actions[symbols[i]](*this, repetitionCounter);
+				(*action)(*this, modules.Parameters(i), modules.ParameterCount(i));
 			}
 		}
 	}
 
+	// Same as above, but the actions come from a policy object that is called as actions(turtle, symbol, parameters, parameterCount)
+	// for every module. The call is resolved at compile time, so a switch over the symbols in the policy
+	// and the turtle methods it calls are inlined into this loop.
+	template<class ActionPolicy>
+	void GenerateSkeleton(const ModuleStream& modules, ActionPolicy&& actions, TTransform startTransform = TTransform{})
+	{
+		Clear();
+		transform = std::move(startTransform);
+
+		size_t size = modules.Size();
+		for (size_t i = 0; i < size; i++)
+		{
+			actions(*this, modules.symbols[i], modules.Parameters(i), modules.ParameterCount(i));
+		}
+	}
+
+	// Parallel version of the policy interpreter. Bracketed blocks of at most modulesPerTask modules are cut out of the
+	// stream and interpreted by their own turtles on worker threads, the remaining modules (the trunk) run first on
+	// this turtle and record the transform and active bone every block starts from. The bones of the blocks are then
+	// stitched in between the trunk bones in stream order, so the skeleton has the same layout as a serial run.
+	// Every block gets its own policy from makeActions(generator) with a generator seeded from (seed, block), the
+	// trunk is block 0. The blocks only depend on the stream, so the result is the same for any thread count.
+	// Like the serial interpreter this relies on '[' and ']' pushing and popping the turtle state.
+	template<class ActionFactory>
+	void GenerateSkeletonParallel(const ModuleStream& modules, ActionFactory&& makeActions, uint64_t seed, unsigned int threadCount = 0,
+		size_t modulesPerTask = 4096, TTransform startTransform = TTransform{})
+	{
+		struct Block
+		{
+			size_t begin = 0;
+			size_t end = 0;				// one past the closing bracket
+			TTransform entryTransform;
+			uint32_t entryBone = TurtleBone::None;
+			uint32_t trunkBonesBefore = 0;
+			BonePool<OptionalState> bones; // bones[0] is a copy of the entry bone, the parent of the first bones of the block
+		};
+
+		threadCount = (threadCount == 0) ? Threads::Count() : threadCount;
+		threadCount = (threadCount == 0) ? 1 : threadCount;
+		size_t size = modules.Size();
+
+		// The largest bracketed blocks that fit in a task
+		std::vector<size_t> blockEnds(size, 0);
+		{
+			std::vector<size_t> openBrackets;
+			for (size_t i = 0; i < size; i++)
+			{
+				if (modules.symbols[i] == '[')
+				{
+					openBrackets.push_back(i);
+				}
+				else if (modules.symbols[i] == ']' && !openBrackets.empty())
+				{
+					blockEnds[openBrackets.back()] = i + 1;
+					openBrackets.pop_back();
+				}
+			}
+		}
+
+		// Interpret the trunk, skipping over the blocks once there is a bone to attach them to
+		Clear();
+		transform = std::move(startTransform);
+
+		std::vector<Block> blocks;
+		UniformRandomGenerator trunkGenerator = UniformRandomGenerator::Substream(seed, 0);
+		auto trunkActions = makeActions(trunkGenerator);
+		for (size_t i = 0; i < size; i++)
+		{
+			size_t blockEnd = blockEnds[i];
+			if (blockEnd > 0 && blockEnd - i <= modulesPerTask && activeBone != TurtleBone::None)
+			{
+				Block& block = blocks.emplace_back();
+				block.begin = i;
+				block.end = blockEnd;
+				block.entryTransform = transform;
+				block.entryBone = activeBone;
+				block.trunkBonesBefore = uint32_t(bones.Size());
+				i = blockEnd - 1;
+				continue;
+			}
+
+			trunkActions(*this, modules.symbols[i], modules.Parameters(i), modules.ParameterCount(i));
+		}
+
+		// Interpret the blocks
+		std::atomic<size_t> nextBlock{ 0 };
+		auto runBlocks = [&]()
+		{
+			for (size_t b = nextBlock++; b < blocks.size(); b = nextBlock++)
+			{
+				Block& block = blocks[b];
+				UniformRandomGenerator blockGenerator = UniformRandomGenerator::Substream(seed, b + 1);
+				auto blockActions = makeActions(blockGenerator);
+
+				Turtle3D blockTurtle;
+				blockTurtle.ReserveStates(stateStack.size());
+				blockTurtle.transform = block.entryTransform;
+				blockTurtle.activeBone = blockTurtle.bones.NewRoot();
+				TurtleBone& entryBone = blockTurtle.bones[0];
+				entryBone.transform = bones[block.entryBone].transform;
+				entryBone.length = bones[block.entryBone].length;
+				entryBone.nodeDepth = bones[block.entryBone].nodeDepth;
+
+				for (size_t i = block.begin; i < block.end; i++)
+				{
+					blockActions(blockTurtle, modules.symbols[i], modules.Parameters(i), modules.ParameterCount(i));
+				}
+				block.bones = std::move(blockTurtle.bones);
+			}
+		};
+
+		unsigned int workerCount = (blocks.size() < threadCount) ? (unsigned int)blocks.size() : threadCount;
+		std::vector<std::thread> workers;
+		for (unsigned int w = 1; w < workerCount; w++)
+		{
+			workers.emplace_back(runBlocks);
+		}
+		runBlocks();
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+
+		if (blocks.empty())
+		{
+			return;
+		}
+
+		// Stitch the block bones in between the trunk bones
+		BonePool<OptionalState> trunkBones = std::move(bones);
+		std::vector<uint32_t> trunkIndices(trunkBones.Size());
+		size_t totalBones = trunkBones.Size();
+		for (const Block& block : blocks)
+		{
+			totalBones += block.bones.Size() - 1;
+		}
+
+		bones.Clear();
+		bones.storage.reserve(totalBones);
+		uint32_t trunkBone = 0;
+		auto copyTrunk = [&](uint32_t end)
+		{
+			for (; trunkBone < end; trunkBone++)
+			{
+				trunkIndices[trunkBone] = uint32_t(bones.Size());
+				TurtleBone& bone = bones.storage.emplace_back(trunkBones[trunkBone]);
+				bone.parent = (bone.parent == TurtleBone::None) ? TurtleBone::None : trunkIndices[bone.parent];
+			}
+		};
+
+		for (const Block& block : blocks)
+		{
+			copyTrunk(block.trunkBonesBefore);
+
+			uint32_t base = uint32_t(bones.Size()) - 1; // block bone i (i > 0) goes to base + i
+			for (uint32_t i = 1; i < uint32_t(block.bones.Size()); i++)
+			{
+				TurtleBone& bone = bones.storage.emplace_back(block.bones[i]);
+				bone.parent = (bone.parent == 0) ? trunkIndices[block.entryBone] : base + bone.parent;
+			}
+		}
+		copyTrunk(uint32_t(trunkBones.Size()));
+
+		// Creation order is kept, so linking every bone to its parent in order gives the same sibling order
+		for (TurtleBone& bone : bones.storage)
+		{
+			bone.firstChild = bone.lastChild = bone.previousSibling = bone.nextSibling = TurtleBone::None;
+		}
+		for (uint32_t i = 0; i < uint32_t(bones.Size()); i++)
+		{
+			uint32_t parent = bones[i].parent;
+			if (parent == TurtleBone::None)
+			{
+				continue;
+			}
+
+			if (bones[parent].firstChild == TurtleBone::None)
+			{
+				bones[parent].firstChild = i;
+			}
+			else
+			{
+				bones[i].previousSibling = bones[parent].lastChild;
+				bones[bones[parent].lastChild].nextSibling = i;
+			}
+			bones[parent].lastChild = i;
+		}
+
+		activeBone = (activeBone == TurtleBone::None) ? TurtleBone::None : trunkIndices[activeBone];
+		boneCount = int(bones.Size());
+	}
+
+	void CompileActions()
+	{
+		actionTable.fill(nullptr);
+		for (auto& action : actions)
+		{
+			if (action.second)
+			{
+				actionTable[(unsigned char)action.first] = &action.second;
+			}
+		}
+
+		moduleActionTable.fill(nullptr);
+		for (auto& action : moduleActions)
+		{
+			if (action.second)
+			{
+				moduleActionTable[(unsigned char)action.first] = &action.second;
+			}
+		}
+	}
+
+	void RunAction(char symbol, int repetitions)
+	{
+		Action* action = actionTable[(unsigned char)symbol];
+		if (repetitions > 0 && action)
+		{
+			(*action)(*this, repetitions);
+		}
+	}
+
 	void PushState()
 	{
-		branchStack.push(activeBone);
+		// Only deeper nesting than reserved grows the stack
+		if (stateCount == stateStack.size())
+		{
+			stateStack.resize(stateCount * 2 + 1);
+		}
 
-		transformStack.push(transform);
+		SavedState& saved = stateStack[stateCount++];
+		saved.transform = transform;
+		saved.activeBone = activeBone;
 	}
 
 	void PopState()
 	{
-		transform = transformStack.top();
-		transformStack.pop();
-
-		activeBone = branchStack.top();
-		branchStack.pop();
+		const SavedState& saved = stateStack[--stateCount];
+		transform = saved.transform;
+		activeBone = saved.activeBone;
 	}
 
 	// Angles are related to the forward and up basis vectors. (Roll is applied first)
 	void Rotate(float rollDegrees, float pitchDegrees)
 	{
-		glm::mat4 identity{ 1 };
-
 		// Roll the forward direction
-		auto rollRot = glm::rotate(identity, glm::radians(rollDegrees), transform.forward);
-		transform.up = rollRot * glm::fvec4(transform.up, 0.0f);
+		float rollRadians = glm::radians(rollDegrees);
+		transform.up = RotateVector(transform.up, transform.forward, glm::cos(rollRadians), glm::sin(rollRadians));
 
 		// Change the up/down angle of the forward direction and up direction
 		glm::fvec3 pitchVector = glm::cross(transform.forward, transform.up);
 		Rotate(pitchDegrees, pitchVector);
 	}
 
+	// Rodrigues' rotation of the frame around the axis, the axis does not need to be normalized
 	void Rotate(float degrees, glm::fvec3 rotateVector)
 	{
-		auto rotateMatrix = glm::rotate(glm::mat4{ 1.0f }, glm::radians(degrees), rotateVector);
-		transform.forward = rotateMatrix * glm::fvec4(transform.forward, 0.0f);
-		transform.up = rotateMatrix * glm::fvec4(transform.up, 0.0f);
+		float lengthSquared = glm::dot(rotateVector, rotateVector);
+		if (lengthSquared <= 0.0f)
+		{
+			return;
+		}
+
+		glm::fvec3 axis = rotateVector * glm::inversesqrt(lengthSquared);
+		float radians = glm::radians(degrees);
+		float cosAngle = glm::cos(radians);
+		float sinAngle = glm::sin(radians);
+		transform.forward = RotateVector(transform.forward, axis, cosAngle, sinAngle);
+		transform.up = RotateVector(transform.up, axis, cosAngle, sinAngle);
+
+		// Rounding errors slowly skew the frame, so it is made orthonormal again every now and then
+		if (++rotationsSinceOrthonormalize >= OrthonormalizeInterval)
+		{
+			Orthonormalize();
+		}
+	}
+
+	void Orthonormalize()
+	{
+		transform.forward = glm::normalize(transform.forward);
+		transform.up = glm::normalize(transform.up - transform.forward * glm::dot(transform.up, transform.forward));
+		rotationsSinceOrthonormalize = 0;
+	}
+
+	// Rotates v around the unit axis
+	static glm::fvec3 RotateVector(glm::fvec3 v, glm::fvec3 axis, float cosAngle, float sinAngle)
+	{
+		return v * cosAngle + glm::cross(axis, v) * sinAngle + axis * (glm::dot(axis, v) * (1.0f - cosAngle));
 	}
 
 	void MoveForward(float distance)
@@ -230,43 +698,39 @@ public:
 
 	void PushBone(float length)
 	{
-		if (!rootBone)
+		if (bones.Empty())
 		{
-			rootBone = new TurtleBone{};
-			activeBone = rootBone;
+			activeBone = bones.NewRoot();
 		}
 		else
 		{
-			activeBone = activeBone->NewChild();
+			// A pop back to before the first bone continues from the root
+			activeBone = bones.NewChild((activeBone == TurtleBone::None) ? 0 : activeBone);
 		}
-		activeBone->transform = transform;
-		activeBone->length = length;
+		TurtleBone& bone = bones[activeBone];
+		bone.transform = transform;
+		bone.length = length;
 		boneCount++;
 	}
 
 	void ForEachBone(std::function<void(TurtleBone*)> callback)
 	{
-		if (rootBone && callback)
+		if (callback)
 		{
-			rootBone->ForEach(callback);
+			bones.ForEach(callback);
 		}
 	}
 
+	void Flatten(FlatSkeleton& skeleton) const
+	{
+		skeleton.Build(bones);
+	}
+
 	void BonesToGLLines(GLLine& lines, glm::fvec4 boneColor, glm::fvec4 normalColor)
 	{
-		ForEachBone([&lines, &boneColor, &normalColor](TurtleBone* b) -> void
-		{
-			lines.AddLine(
-				b->transform.position,
-				b->tipPosition(),
-				boneColor
-			);
-			lines.AddLine(
-				b->transform.position,
-				b->transform.position + b->transform.up*0.2f,
-				normalColor
-			);
-		});
+		FlatSkeleton skeleton;
+		Flatten(skeleton);
+		skeleton.ToGLLines(lines, boneColor, normalColor);
 		lines.SendToGPU();
 	}
 };
\ No newline at end of file
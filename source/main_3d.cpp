@@ -26,12 +26,15 @@
 #include "core/threads.h"
 #include "core/utilities.h"
 #include "core/input.h"
+#include "core/filelistener.h"
 
 #include "generation/turtle3d.h"
 #include "generation/lsystem.h"
 #include "generation/fractals.h"
+#include "generation/grammarfile.h"
 
 #include "tree.h"
+#include "treecache.h"
 
 /*
 	Program configurations
@@ -43,6 +46,7 @@ static const int WINDOW_HEIGHT = 720;
 static const float CAMERA_FOV = 60.0f;
 static const float WINDOW_RATIO = WINDOW_WIDTH / float(WINDOW_HEIGHT);
 static const int FPS_LIMIT = 0;
+static const double TREE_MEMORY_BUDGET = 1024.0 * 1024.0 * 1024.0; // trees predicted to need more bytes than this are not generated
 
 namespace fs = std::filesystem;
 
@@ -84,6 +88,8 @@ printf(R"(
 
         G:              Generate new tree with current settings
         T:              Toggle between default and slimmer tree style
+        P:              Toggle the tree from content/fractal_tree.lsys
+                        (rebuilt whenever the file is saved)
         Up arrow:       Increase L-system iterations (bigger tree)
         Down arrow:     Decrease L-system iterations (smaller tree)
         Left arrow:     Decrease branch divisions
@@ -91,9 +97,10 @@ printf(R"(
 
         ESC:            Close the application
 
-    Please note that iterations greater than 6 takes a long time.
-    The application will not refresh during generations and will
-    appear to "hang".
+    The size of every tree is predicted before it is generated.
+    Settings that would need more than 1 GB are refused and the
+    previous settings are kept. Large trees still take a while and
+    the application will not refresh during generation.
 
 ====================================================================
 )");
@@ -158,9 +165,25 @@ printf(R"(
 	*/
 	GLLine skeletonLines, coordinateReferenceLines;
 	GLTriangleMesh branchMeshes, crownLeavesMeshes;
-	auto GenerateRandomTree = [&](TreeStyle style = TreeStyle::Default, int iterations = 5, int subdivisions = 3) {
-		printf("\r\nGenerating %s (%d iterations, %d subdivisions)... ", (style == TreeStyle::Default) ? "tree" : "slimmer tree", iterations, subdivisions);
-		GenerateNewTree(style, skeletonLines, branchMeshes, crownLeavesMeshes, leafMesh, uniformGenerator, iterations, subdivisions);
+	GrammarProgram species;
+	const GrammarProgram* activeSpecies = nullptr; // set while the tree comes from the species file
+	TreeCache treeCache{ fs::current_path().parent_path() / "temp" / "treecache" };
+	FractalTree3DGrammarCache grammarCache;
+	uint64_t treeSeed = uniformGenerator.RandomInt(); // only G grows a new tree, the other keys regrow this one
+	auto GenerateRandomTree = [&](TreeStyle style = TreeStyle::Default, int iterations = 5, int subdivisions = 3) -> bool {
+		SpeciesDescriptor descriptor = FractalTree3DSpecies(style);
+		TreeEstimate estimate = EstimateNewTree(descriptor, leafMesh, iterations, subdivisions, activeSpecies);
+		printf("\r\nEstimated %.0f bones, %.0f triangles, %.1f MB", estimate.bones, estimate.branchTriangles + estimate.leafTriangles, estimate.memoryBytes / (1024.0 * 1024.0));
+		if (estimate.memoryBytes > TREE_MEMORY_BUDGET)
+		{
+			printf("\r\nSkipped %d iterations, %d subdivisions: the tree would exceed the %.0f MB memory budget", iterations, subdivisions, TREE_MEMORY_BUDGET / (1024.0 * 1024.0));
+			return false;
+		}
+
+		const char* treeName = activeSpecies ? "species file tree" : (style == TreeStyle::Default) ? "tree" : "slimmer tree";
+		printf("\r\nGenerating %s (%d iterations, %d subdivisions, seed %016llx)... ", treeName, iterations, subdivisions, (unsigned long long)treeSeed);
+		GenerateNewTree(descriptor, skeletonLines, branchMeshes, crownLeavesMeshes, leafMesh, treeSeed, iterations, subdivisions, activeSpecies, &treeCache, &grammarCache);
+		return true;
 	};
 	GenerateRandomTree();
 
@@ -185,6 +208,28 @@ printf(R"(
 	int treeIterations = 5;
 	int treeSubdivisions = 3;
 
+	/*
+		Species file, the tree is rebuilt whenever the file is saved
+	*/
+	const std::wstring speciesFilename = L"fractal_tree.lsys";
+	auto LoadSpecies = [&]() -> bool {
+		if (!species.Load(contentFolder / speciesFilename))
+		{
+			printf("\r\nFailed to load species: %s", species.error.c_str());
+			return false;
+		}
+		return true;
+	};
+
+	FileListener speciesListener;
+	speciesListener.Bind(speciesFilename, [&](fs::path) -> void {
+		if (activeSpecies && LoadSpecies())
+		{
+			GenerateRandomTree(treeStyle, treeIterations, treeSubdivisions);
+		}
+	});
+	speciesListener.StartThread(contentFolder);
+
 	/*
 		Main application loop
 	*/
@@ -212,6 +257,7 @@ printf(R"(
 
 		window.SetTitle("FPS: " + FpsString(deltaTime));
 		shaderManager.CheckLiveShaders();
+		speciesListener.ProcessCallbacksOnMainThread();
 
 		SDL_Event event;
 		while (SDL_PollEvent(&event))
@@ -222,6 +268,10 @@ printf(R"(
 			if (event.type == SDL_KEYDOWN)
 			{
 				auto key = event.key.keysym.sym;
+				TreeStyle previousStyle = treeStyle;
+				int previousIterations = treeIterations;
+				int previousSubdivisions = treeSubdivisions;
+				const GrammarProgram* previousSpecies = activeSpecies;
 
 				if		(key == SDLK_4) renderWireframe = true;
 				else if (key == SDLK_5) renderWireframe = false;
@@ -229,6 +279,7 @@ printf(R"(
 				else if (key == SDLK_s) TakeScreenshot("screenshot.png", WINDOW_WIDTH, WINDOW_HEIGHT);
 				else if (key == SDLK_f) turntable.SnapToOrigin();
 				else if (key == SDLK_t)		treeStyle = (treeStyle == TreeStyle::Default) ? TreeStyle::Slim : TreeStyle::Default;
+				else if (key == SDLK_p)		activeSpecies = (!activeSpecies && LoadSpecies()) ? &species : nullptr;
 				else if (key == SDLK_UP)    ++treeIterations;
 				else if (key == SDLK_DOWN)  treeIterations = (treeIterations <= 1) ? 1 : treeIterations - 1;
 				else if (key == SDLK_LEFT)  treeSubdivisions = (treeSubdivisions <= 1) ? 1 : treeSubdivisions - 1;
@@ -236,9 +287,16 @@ printf(R"(
 
 				switch (key)
 				{
-				case SDLK_g:case SDLK_t:case SDLK_UP:case SDLK_DOWN:case SDLK_LEFT:case SDLK_RIGHT:
+				case SDLK_g:case SDLK_t:case SDLK_p:case SDLK_UP:case SDLK_DOWN:case SDLK_LEFT:case SDLK_RIGHT:
 				{
-					GenerateRandomTree(treeStyle, treeIterations, treeSubdivisions);
+					if (key == SDLK_g) treeSeed = uniformGenerator.RandomInt();
+					if (!GenerateRandomTree(treeStyle, treeIterations, treeSubdivisions))
+					{
+						treeStyle = previousStyle;
+						treeIterations = previousIterations;
+						treeSubdivisions = previousSubdivisions;
+						activeSpecies = previousSpecies;
+					}
 				}
 				default: { break; }
 				}
@@ -0,0 +1,1167 @@
+// STL includes
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stack>
+#include <chrono>
+#include <functional>
+#include <type_traits>
+#include <filesystem>
+
+// Application includes
+#include "core/threads.h"
+#include "generation/lsystem.h"
+#include "generation/parametric.h"
+#include "generation/derivation.h"
+#include "generation/grammarfile.h"
+#include "generation/turtle3d.h"
+#include "generation/fractals.h"
+#include "tree.h"
+#include "treecache.h"
+
+/*
+	Helpers
+*/
+// Runs the function until at least minSeconds have passed and returns the average time per run.
+// A function that returns a double reports the time of the part it wants measured, excluding its setup.
+template<class Function>
+double MeasureSeconds(Function&& function, double minSeconds = 0.25)
+{
+	using BenchmarkClock = std::chrono::high_resolution_clock;
+
+	int runs = 0;
+	double elapsed = 0.0;
+	double measured = 0.0;
+	auto start = BenchmarkClock::now();
+	while (elapsed < minSeconds)
+	{
+		if constexpr (std::is_same_v<decltype(function()), double>)
+		{
+			measured += function();
+		}
+		else
+		{
+			function();
+		}
+		runs++;
+		elapsed = std::chrono::duration<double>(BenchmarkClock::now() - start).count();
+	}
+
+	bool reportsTime = std::is_same_v<decltype(function()), double>;
+	return (reportsTime ? measured : elapsed) / double(runs);
+}
+
+// The rewrite loop as it was before the rules were compiled, two std::map lookups per symbol
+std::string RunProductionWithMap(LSystemString& lsystem, int iterations)
+{
+	std::string production = lsystem.axiom;
+
+	while (--iterations >= 0)
+	{
+		std::string newString;
+		for (char c : production)
+		{
+			if (lsystem.productionRules.count(c))
+			{
+				newString.append(lsystem.productionRules[c]);
+			}
+			else
+			{
+				newString.append(1, c);
+			}
+		}
+		production = newString;
+	}
+
+	return production;
+}
+
+// The bone layout before BonePool, one heap allocation per bone, pointer links and a recursive destructor
+struct LinkedBone
+{
+	LinkedBone* parent = nullptr;
+	LinkedBone* firstChild = nullptr;
+	LinkedBone* lastChild = nullptr;
+	LinkedBone* previousSibling = nullptr;
+	LinkedBone* nextSibling = nullptr;
+
+	TurtleTransform<FractalTree3DProps> transform;
+	float length = 0.0f;
+	int nodeDepth = 1;
+
+	~LinkedBone()
+	{
+		delete firstChild;
+		delete nextSibling;
+	}
+
+	LinkedBone* NewChild()
+	{
+		LinkedBone* newChild = new LinkedBone();
+		if (!firstChild)
+		{
+			firstChild = newChild;
+		}
+		else
+		{
+			newChild->previousSibling = lastChild;
+			lastChild->nextSibling = newChild;
+		}
+		lastChild = newChild;
+		newChild->parent = this;
+		newChild->transform.position = transform.position + transform.forward*length;
+		newChild->nodeDepth = nodeDepth + 1;
+		return newChild;
+	}
+};
+
+// Turtle3D::Rotate as it was before the Rodrigues update, two mat4 rotations per roll and pitch
+void RotateWithMatrices(TurtleTransform<FractalTree3DProps>& transform, float rollDegrees, float pitchDegrees)
+{
+	glm::mat4 identity{ 1 };
+	auto rollRot = glm::rotate(identity, glm::radians(rollDegrees), transform.forward);
+	transform.up = rollRot * glm::fvec4(transform.up, 0.0f);
+
+	glm::fvec3 pitchVector = glm::cross(transform.forward, transform.up);
+	auto rotateMatrix = glm::rotate(identity, glm::radians(pitchDegrees), pitchVector);
+	transform.forward = rotateMatrix * glm::fvec4(transform.forward, 0.0f);
+	transform.up = rotateMatrix * glm::fvec4(transform.up, 0.0f);
+}
+
+double SecondsSince(std::chrono::high_resolution_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+void PrintResult(const char* name, double seconds, uint64_t symbols, double baselineSeconds)
+{
+	printf("    %-28s %9.2f ms %10.1f Msymbols/s %6.2fx\n", name, seconds * 1000.0, symbols / seconds / 1e6, baselineSeconds / seconds);
+}
+
+
+/*
+	Benchmarks
+*/
+void BenchmarkLSystemRules()
+{
+	struct GrammarCase
+	{
+		const char* name;
+		LSystemString lsystem;
+		int iterations;
+	};
+
+	std::vector<GrammarCase> grammars{
+		{ "Fractal tree", FractalTreeGrammar(), 14 },
+		{ "Koch curve", KochCurveGrammar(), 8 },
+		{ "Sierpinski triangle", SierpinskiTriangleGrammar(), 10 },
+		{ "Dragon curve", DragonCurveGrammar(), 20 },
+		{ "Fractal plant", FractalPlantGrammar(), 7 },
+		{ "Fractal leaf", FractalLeafGrammar(), 11 },
+		{ "Fractal tree 3D", FractalTree3DGrammar(FractalTree3DSpecies(TreeStyle::Default)), 14 }
+	};
+
+	printf("\nL-system expansion (std::map rules vs compiled table)\n");
+	for (GrammarCase& g : grammars)
+	{
+		CompiledLSystem compiled = g.lsystem.Compile();
+		uint64_t symbols = compiled.ProductionLength(g.iterations);
+		printf("  %s, %d iterations, %llu symbols\n", g.name, g.iterations, (unsigned long long)symbols);
+
+		size_t checksum = 0;
+		double mapSeconds = MeasureSeconds([&]() { checksum += RunProductionWithMap(g.lsystem, g.iterations).size(); });
+		double compiledSeconds = MeasureSeconds([&]() { checksum += compiled.RunProduction(g.iterations).size(); });
+		double exactSeconds = MeasureSeconds([&]() { checksum += compiled.RunProductionExact(g.iterations).size(); });
+		double parallelSeconds = MeasureSeconds([&]() { checksum += compiled.RunProductionParallel(g.iterations).size(); });
+		double streamSeconds = MeasureSeconds([&]() { compiled.StreamProduction(g.iterations, [&checksum](char c) { checksum += c; }); });
+
+		DerivationGraph graph{ compiled, g.iterations };
+		double graphSeconds = MeasureSeconds([&]() { graph.StreamProduction(g.iterations, [&checksum](char c) { checksum += c; }); });
+
+		PrintResult("std::map", mapSeconds, symbols, mapSeconds);
+		PrintResult("compiled table", compiledSeconds, symbols, mapSeconds);
+		PrintResult("compiled exact size", exactSeconds, symbols, mapSeconds);
+		PrintResult("compiled parallel", parallelSeconds, symbols, mapSeconds);
+		PrintResult("compiled stream", streamSeconds, symbols, mapSeconds);
+		PrintResult("derivation graph walk", graphSeconds, symbols, mapSeconds);
+		printf("    derivation graph: %zu nodes, %zu child references\n", graph.nodes.size(), graph.children.size());
+
+		if (checksum == 0) printf("    (empty production)\n");
+
+		// Every expansion method has to give the string of the serial compiled table, byte for byte
+		std::string expected = compiled.RunProduction(g.iterations);
+		std::string streamed;
+		std::string walked;
+		compiled.StreamProduction(g.iterations, [&streamed](char c) { streamed.push_back(c); });
+		graph.StreamProduction(g.iterations, [&walked](char c) { walked.push_back(c); });
+
+		bool identical = true;
+		auto compare = [&](const char* name, const std::string& production)
+		{
+			if (production != expected)
+			{
+				printf("    %s output is DIFFERENT from the compiled table\n", name);
+				identical = false;
+			}
+		};
+		compare("compiled exact size", compiled.RunProductionExact(g.iterations));
+		compare("compiled parallel", compiled.RunProductionParallel(g.iterations));
+		compare("compiled stream", streamed);
+		compare("derivation graph walk", walked);
+		if (identical) printf("    all expansions give identical output\n");
+	}
+
+	// An erasing rule (X -> nothing) gives graph nodes without children that are not final symbols,
+	// including right at the axiom
+	bool erasingMatches = true;
+	for (const char* axiom : { "XA", "X", "AXXA" })
+	{
+		LSystemString erasing;
+		erasing.axiom = axiom;
+		erasing.productionRules['X'] = "";
+		erasing.productionRules['A'] = "A[B]";
+
+		CompiledLSystem compiled = erasing.Compile();
+		DerivationGraph graph{ compiled, 6 };
+		for (int iterations = 0; iterations <= 6; iterations++)
+		{
+			std::string expected = compiled.RunProduction(iterations);
+			std::string walked;
+			graph.StreamProduction(iterations, [&walked](char c) { walked.push_back(c); });
+			erasingMatches = erasingMatches && walked == expected && graph.RunProduction(iterations) == expected
+				&& graph.ProductionLength(iterations) == expected.size() && graph.MaxBracketDepth(iterations) == compiled.MaxBracketDepth(iterations);
+		}
+	}
+	printf("  Erasing rules, derivation graph against the compiled table: %s\n", erasingMatches ? "identical" : "DIFFERENT");
+}
+
+void BenchmarkContextSensitive()
+{
+	// A[B]C: the sub-branch is skipped, so A and C are each other's neighbours, and B sees A before it
+	LSystemContextSensitive contextCheck;
+	contextCheck.axiom = "A[B]C";
+	BracketIndex index;
+	index.Build(contextCheck.axiom);
+	bool passed = contextCheck.Matches(LSystemContextSensitive::Rule{ "A", "", "" }, contextCheck.axiom, index, 4)
+		&& contextCheck.Matches(LSystemContextSensitive::Rule{ "", "C", "" }, contextCheck.axiom, index, 0)
+		&& contextCheck.Matches(LSystemContextSensitive::Rule{ "A", "", "" }, contextCheck.axiom, index, 2)
+		&& !contextCheck.Matches(LSystemContextSensitive::Rule{ "B", "", "" }, contextCheck.axiom, index, 4);
+	printf("\nContext-sensitive rules, A[B]C matches A < C and A > C: %s\n", passed ? "passed" : "FAILED");
+
+	// Every pass rewrites the whole previous generation, so the time per rewritten symbol stays flat when matching is linear
+	LSystemContextSensitive signalPlant = SignalPropagationGrammar();
+	printf("Signal propagation plant (time per rewritten symbol)\n");
+	for (int iterations = 30; iterations <= 45; iterations += 5)
+	{
+		uint64_t rewritten = 0;
+		LSystemContextSensitive step = signalPlant;
+		for (int i = 0; i < iterations; i++)
+		{
+			rewritten += step.axiom.size();
+			step.axiom = step.RunProduction(1);
+		}
+
+		size_t symbols = 0;
+		double seconds = MeasureSeconds([&]() { symbols = signalPlant.RunProduction(iterations).size(); });
+		printf("  %d iterations, %zu symbols, %llu rewritten %9.2f ms %8.1f ns/symbol\n", iterations, symbols,
+			(unsigned long long)rewritten, seconds * 1000.0, seconds * 1e9 / double(rewritten));
+	}
+}
+
+void BenchmarkTurtleActions()
+{
+	using Turtle = Turtle3D<FractalTree3DProps>;
+
+	Turtle turtle;
+	turtle.actions['A'] = [](Turtle& t, int repetitions) { t.transform.position.y += float(repetitions); };
+	turtle.actions['C'] = turtle.actions['A'];
+	turtle.actions['%'] = [](Turtle& t, int repetitions) { t.transform.properties.lengthFactor *= 0.87f; };
+	turtle.actions['['] = [](Turtle& t, int repetitions) { t.PushState(); };
+	turtle.actions[']'] = [](Turtle& t, int repetitions) { t.PopState(); };
+	turtle.actions['+'] = [](Turtle& t, int repetitions) { t.transform.position.x += float(repetitions); };
+
+	const int iterations = 14;
+	std::string symbols = FractalTree3DGrammar(FractalTree3DSpecies(TreeStyle::Default)).RunProduction(iterations);
+	printf("\nTurtle3D action dispatch (std::map vs action table), %d iterations, %zu symbols\n", iterations, symbols.size());
+
+	double mapSeconds = MeasureSeconds([&]()
+	{
+		turtle.transform.Clear();
+		for (char c : symbols)
+		{
+			if (turtle.actions.count(c))
+			{
+				turtle.actions[c](turtle, 1);
+			}
+		}
+	});
+
+	turtle.CompileActions();
+	double tableSeconds = MeasureSeconds([&]()
+	{
+		turtle.transform.Clear();
+		for (char c : symbols)
+		{
+			turtle.RunAction(c, 1);
+		}
+	});
+
+	PrintResult("std::map", mapSeconds, symbols.size(), mapSeconds);
+	PrintResult("action table", tableSeconds, symbols.size(), mapSeconds);
+}
+
+void BenchmarkParametricTree()
+{
+	const int iterations = 14;
+	LSystemString stringTree = FractalTree3DGrammar(FractalTree3DSpecies(TreeStyle::Default));
+	ParametricLSystem parametricTree = FractalTree3DParametricGrammar(FractalTree3DSpecies(TreeStyle::Default));
+
+	uint64_t symbols = stringTree.ProductionLength(iterations);
+	size_t modules = parametricTree.RunProduction(iterations).Size();
+	printf("\nFractal tree 3D (character string vs parametric modules), %d iterations, %llu symbols, %zu modules\n", iterations, (unsigned long long)symbols, modules);
+
+	size_t checksum = 0;
+	ModuleStream stream;
+	double stringSeconds = MeasureSeconds([&]() { stringTree.ClearCache(); checksum += stringTree.RunProduction(iterations).size(); });
+	double parametricSeconds = MeasureSeconds([&]() { parametricTree.ClearCache(); parametricTree.RunProduction(iterations, stream); checksum += stream.Size(); });
+
+	PrintResult("character string", stringSeconds, symbols, stringSeconds);
+	PrintResult("parametric modules", parametricSeconds, symbols, stringSeconds);
+
+	if (checksum == 0) printf("    (empty production)\n");
+}
+
+void BenchmarkIterationScrubbing()
+{
+	const int iterations = 14;
+	LSystemString stringTree = FractalTree3DGrammar(FractalTree3DSpecies(TreeStyle::Default));
+	ParametricLSystem parametricTree = FractalTree3DParametricGrammar(FractalTree3DSpecies(TreeStyle::Default));
+	uint64_t symbols = stringTree.ProductionLength(iterations);
+	printf("\nStepping from %d to %d iterations (full expansion vs cached iterations)\n", iterations - 1, iterations);
+
+	// Without the cache every step expands from the axiom
+	size_t checksum = 0;
+	ModuleStream stream;
+	double fullSeconds = MeasureSeconds([&]() { stringTree.ClearCache(); checksum += stringTree.RunProduction(iterations).size(); });
+	double stepSeconds = MeasureSeconds([&]()
+	{
+		stringTree.ClearCache();
+		stringTree.RunProduction(iterations - 1);
+		auto start = std::chrono::high_resolution_clock::now();
+		checksum += stringTree.RunProduction(iterations).size();
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	});
+	double parametricFullSeconds = MeasureSeconds([&]() { parametricTree.ClearCache(); parametricTree.RunProduction(iterations, stream); checksum += stream.Size(); });
+	double parametricStepSeconds = MeasureSeconds([&]()
+	{
+		parametricTree.ClearCache();
+		parametricTree.RunProduction(iterations - 1, stream);
+		auto start = std::chrono::high_resolution_clock::now();
+		parametricTree.RunProduction(iterations, stream);
+		checksum += stream.Size();
+		return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+	});
+	double cachedSeconds = MeasureSeconds([&]() { checksum += stringTree.RunProduction(iterations - 1).size(); });
+
+	PrintResult("string from axiom", fullSeconds, symbols, fullSeconds);
+	PrintResult("string one more pass", stepSeconds, symbols, fullSeconds);
+	PrintResult("string step back (cached)", cachedSeconds, symbols, fullSeconds);
+	PrintResult("parametric from axiom", parametricFullSeconds, symbols, fullSeconds);
+	PrintResult("parametric one more pass", parametricStepSeconds, symbols, fullSeconds);
+
+	if (checksum == 0) printf("    (empty production)\n");
+}
+
+// The grammar interpreter as it was before the peephole pass, every instruction of every symbol runs on its own.
+// Kept here as the baseline for the fused GrammarProgram::GenerateSkeleton.
+template<class T>
+void GenerateSkeletonUnfused(const GrammarProgram& species, Turtle3D<T>& turtle, UniformRandomGenerator& uniformGenerator, int iterations)
+{
+	turtle.Clear();
+
+	int maxBracketDepth = species.lsystem.MaxBracketDepth(iterations);
+	turtle.ReserveStates(maxBracketDepth);
+
+	float scale = 1.0f;
+	std::vector<float> scaleStack;
+	scaleStack.reserve(maxBracketDepth);
+	const TurtleInstruction* program = species.instructions.data();
+
+	species.lsystem.StreamProduction(iterations, [&](char c)
+	{
+		const GrammarProgram::InstructionRange& range = species.Find(c);
+		const TurtleInstruction* end = program + range.first + range.count;
+		for (const TurtleInstruction* instruction = program + range.first; instruction != end; instruction++)
+		{
+			float value = instruction->minimum;
+			if (instruction->maximum != instruction->minimum)
+			{
+				value = uniformGenerator.RandomFloat(instruction->minimum, instruction->maximum);
+			}
+
+			switch (instruction->opcode)
+			{
+			case TurtleOpcode::Forward: turtle.MoveForward(value * scale); break;
+			case TurtleOpcode::Roll:    turtle.Rotate(value, turtle.transform.forward); break;
+			case TurtleOpcode::Pitch:   turtle.Rotate(value, glm::cross(turtle.transform.forward, turtle.transform.up)); break;
+			case TurtleOpcode::Scale:   scale *= value; break;
+			case TurtleOpcode::Push:    turtle.PushState(); scaleStack.push_back(scale); break;
+			case TurtleOpcode::Pop:
+				if (!scaleStack.empty())
+				{
+					turtle.PopState();
+					scale = scaleStack.back();
+					scaleStack.pop_back();
+				}
+				break;
+			}
+		}
+	});
+}
+
+void BenchmarkGrammarProgram()
+{
+	using Turtle = Turtle3D<FractalTree3DProps>;
+
+	const char* speciesText = R"(
+		axiom B
+		rule B -> AAA[%^B][%+^B][%++^B]%B
+		turtle A roll 0 15; pitch -5 5; forward 1 1.5
+		turtle % scale 0.87
+		turtle + roll 120
+		turtle ^ pitch 20 35
+		turtle [ push; roll 0 45
+		turtle ] pop
+	)";
+
+	GrammarProgram species;
+	if (!species.Parse(speciesText))
+	{
+		printf("\nGrammar program failed to parse: %s\n", species.error.c_str());
+		return;
+	}
+
+	// The same species written as C++ lambdas, dispatched through std::map like the hardcoded trees
+	UniformRandomGenerator uniformGenerator;
+	auto roll = [](Turtle& t, float degrees) { t.Rotate(degrees, t.transform.forward); };
+	auto pitch = [](Turtle& t, float degrees) { t.Rotate(degrees, glm::cross(t.transform.forward, t.transform.up)); };
+	float scale = 1.0f;
+	std::vector<float> scaleStack;
+	std::map<char, std::function<void(Turtle&)>> actions;
+	actions['A'] = [&](Turtle& t)
+	{
+		roll(t, uniformGenerator.RandomFloat(0.0f, 15.0f));
+		pitch(t, uniformGenerator.RandomFloat(-5.0f, 5.0f));
+		t.MoveForward(uniformGenerator.RandomFloat(1.0f, 1.5f) * scale);
+	};
+	actions['%'] = [&](Turtle& t) { scale *= 0.87f; };
+	actions['+'] = [&](Turtle& t) { roll(t, 120.0f); };
+	actions['^'] = [&](Turtle& t) { pitch(t, uniformGenerator.RandomFloat(20.0f, 35.0f)); };
+	actions['['] = [&](Turtle& t) { t.PushState(); scaleStack.push_back(scale); roll(t, uniformGenerator.RandomFloat(0.0f, 45.0f)); };
+	actions[']'] = [&](Turtle& t) { t.PopState(); scale = scaleStack.back(); scaleStack.pop_back(); };
+
+	printf("\nSpecies skeleton (std::map of std::function vs unfused bytecode vs fused bytecode)\n");
+	for (int iterations = 4; iterations <= 7; iterations++)
+	{
+		Turtle turtle;
+		double mapSeconds = MeasureSeconds([&]()
+		{
+			turtle.Clear();
+			scale = 1.0f;
+			species.lsystem.StreamProduction(iterations, [&](char c)
+			{
+				if (actions.count(c))
+				{
+					actions[c](turtle);
+				}
+			});
+		});
+		int bones = turtle.boneCount;
+
+		double programSeconds = MeasureSeconds([&]() { GenerateSkeletonUnfused(species, turtle, uniformGenerator, iterations); });
+		double fusedSeconds = MeasureSeconds([&]() { species.GenerateSkeleton(turtle, uniformGenerator, iterations); });
+
+		// Count what the peephole pass leaves of the instruction stream
+		TurtleMacroCompiler compiler;
+		species.lsystem.StreamProduction(iterations, [&](char c)
+		{
+			const GrammarProgram::InstructionRange& range = species.Find(c);
+			for (uint32_t i = 0; i < range.count; i++)
+			{
+				compiler.Add(species.instructions[range.first + i]);
+			}
+			compiler.Discard(compiler.SettledCount());
+		});
+
+		uint64_t symbols = uint64_t(species.lsystem.EstimateProduction(iterations).length);
+		printf("  %d iterations, %d bones, %llu instructions fused into %llu ops\n", iterations, bones,
+			(unsigned long long)compiler.instructionCount, (unsigned long long)compiler.opCount);
+		PrintResult("std::map actions", mapSeconds, symbols, mapSeconds);
+		PrintResult("unfused bytecode (before)", programSeconds, symbols, mapSeconds);
+		PrintResult("fused bytecode", fusedSeconds, symbols, mapSeconds);
+	}
+}
+
+void BenchmarkTreeSkeleton()
+{
+	using Turtle = Turtle3D<FractalTree3DProps>;
+
+	// The stochastic tree actions as type-erased std::function objects, the way they were written before the policy
+	UniformRandomGenerator uniformGenerator;
+	int grammarIterations = 0;
+	const int subdivisions = 3;
+	const float subDivFactor = 1.0f / float(subdivisions);
+	std::map<char, Turtle::ModuleAction> actions;
+	actions['A'] = [&](Turtle& t, const float* p, int count)
+	{
+		t.transform.properties.lengthFactor = p[1];
+		float randomLengthFactor = uniformGenerator.RandomFloat(1.0f, 1.5f);
+		float drawLength = subDivFactor * p[0] * randomLengthFactor * p[1];
+		float roll = subDivFactor * uniformGenerator.RandomFloat(0.0f, 45.0f);
+		float pitch = subDivFactor * uniformGenerator.RandomFloat(-15.0f, 15.0f);
+		for (int d = 0; d < subdivisions; d++)
+		{
+			t.Rotate(roll, pitch);
+			t.MoveForward(drawLength);
+		}
+	};
+	actions['C'] = actions['A'];
+	actions['['] = [](Turtle& t, const float* p, int count) { t.PushState(); };
+	actions[']'] = [](Turtle& t, const float* p, int count) { t.PopState(); };
+	actions['+'] = [&](Turtle& t, const float* p, int count)
+	{
+		float depth = float(t.ActiveBone()->nodeDepth);
+		t.Rotate(120.0f * int(p[0]) + 45.0f * depth + uniformGenerator.RandomFloat(-30.0f, -30.0f), 25.0f + uniformGenerator.RandomFloat(-5.0f, 10.0f));
+		glm::fvec3 rotVec = glm::cross(glm::fvec3{ 0.0f, 1.0f, 0.0f }, t.transform.forward);
+		t.Rotate(3.0f * grammarIterations / depth, rotVec);
+	};
+
+	printf("\nStochastic 3D tree skeleton (std::map, function table, static action policy, parallel on %u threads)\n", Threads::Count());
+	SpeciesDescriptor species = FractalTree3DSpecies(TreeStyle::Default);
+	ParametricLSystem fractalTree = FractalTree3DParametricGrammar(species);
+	for (int treeIterations = 5; treeIterations <= 8; treeIterations++)
+	{
+		grammarIterations = treeIterations * 2;
+		ModuleStream modules = fractalTree.RunProduction(grammarIterations);
+
+		Turtle turtle;
+		double mapSeconds = MeasureSeconds([&]()
+		{
+			turtle.Clear();
+			for (size_t i = 0; i < modules.Size(); i++)
+			{
+				char c = modules.symbols[i];
+				if (actions.count(c))
+				{
+					actions[c](turtle, modules.Parameters(i), modules.ParameterCount(i));
+				}
+			}
+		});
+
+		turtle.moduleActions = actions;
+		double tableSeconds = MeasureSeconds([&]() { turtle.GenerateSkeleton(modules); });
+		double policySeconds = MeasureSeconds([&]() { turtle.GenerateSkeleton(modules, FractalTree3DActions{ species, uniformGenerator, grammarIterations, subdivisions }); });
+		auto makeActions = [&](UniformRandomGenerator& generator) { return FractalTree3DActions{ species, generator, grammarIterations, subdivisions }; };
+		double parallelSeconds = MeasureSeconds([&]() { turtle.GenerateSkeletonParallel(modules, makeActions, 1); });
+		std::vector<Bone<FractalTree3DProps>> parallelBones = turtle.bones.storage;
+		double singleThreadSeconds = MeasureSeconds([&]() { turtle.GenerateSkeletonParallel(modules, makeActions, 1, 1); });
+
+		// The same seed has to give the same skeleton on any number of threads, bit for bit
+		bool identical = (parallelBones.size() == turtle.bones.Size());
+		for (size_t i = 0; identical && i < parallelBones.size(); i++)
+		{
+			const auto& a = parallelBones[i];
+			const auto& b = turtle.bones.storage[i];
+			identical = a.parent == b.parent && a.length == b.length && a.transform.position == b.transform.position
+				&& a.transform.forward == b.transform.forward && a.transform.up == b.transform.up;
+		}
+
+		printf("  %d iterations, %zu modules, %d bones\n", treeIterations, modules.Size(), turtle.boneCount);
+		PrintResult("std::map + std::function", mapSeconds, modules.Size(), mapSeconds);
+		PrintResult("function table", tableSeconds, modules.Size(), mapSeconds);
+		PrintResult("action policy", policySeconds, modules.Size(), mapSeconds);
+		PrintResult("parallel policy, 1 thread", singleThreadSeconds, modules.Size(), mapSeconds);
+		PrintResult("parallel policy", parallelSeconds, modules.Size(), mapSeconds);
+		printf("    1 thread and %u threads give %s skeletons\n", Threads::Count(), identical ? "identical" : "DIFFERENT");
+	}
+}
+
+
+/*
+	Application
+*/
+
+void BenchmarkBoneStorage()
+{
+	using BenchmarkClock = std::chrono::high_resolution_clock;
+	using TBone = Bone<FractalTree3DProps>;
+
+	printf("\nSkeleton build and teardown (new + pointer links vs BonePool)\n");
+	UniformRandomGenerator uniformGenerator;
+	const int subdivisions = 3;
+	SpeciesDescriptor species = FractalTree3DSpecies(TreeStyle::Default);
+	ParametricLSystem fractalTree = FractalTree3DParametricGrammar(species);
+	for (int treeIterations = 5; treeIterations <= 8; treeIterations++)
+	{
+		int grammarIterations = treeIterations * 2;
+		ModuleStream modules = fractalTree.RunProduction(grammarIterations);
+
+		// Build both layouts from the same tree, so only the storage is measured
+		Turtle3D<FractalTree3DProps> turtle;
+		turtle.GenerateSkeleton(modules, FractalTree3DActions{ species, uniformGenerator, grammarIterations, subdivisions });
+		const std::vector<TBone>& source = turtle.bones.storage;
+
+		int linkedRuns = 0;
+		double linkedBuild = 0.0;
+		double linkedTeardown = 0.0;
+		std::vector<LinkedBone*> linkedBones(source.size());
+		double linkedSeconds = MeasureSeconds([&]()
+		{
+			auto start = BenchmarkClock::now();
+			LinkedBone* root = new LinkedBone();
+			linkedBones[0] = root;
+			for (size_t i = 1; i < source.size(); i++)
+			{
+				linkedBones[i] = linkedBones[source[i].parent]->NewChild();
+				linkedBones[i]->transform = source[i].transform;
+				linkedBones[i]->length = source[i].length;
+			}
+			double build = SecondsSince(start);
+
+			start = BenchmarkClock::now();
+			delete root;
+			double teardown = SecondsSince(start);
+
+			linkedRuns++;
+			linkedBuild += build;
+			linkedTeardown += teardown;
+			return build + teardown;
+		});
+
+		int poolRuns = 0;
+		double poolBuild = 0.0;
+		double poolTeardown = 0.0;
+		double poolSeconds = MeasureSeconds([&]()
+		{
+			BonePool<FractalTree3DProps> pool;
+			auto start = BenchmarkClock::now();
+			pool.NewRoot();
+			for (size_t i = 1; i < source.size(); i++)
+			{
+				TBone& bone = pool[pool.NewChild(source[i].parent)];
+				bone.transform = source[i].transform;
+				bone.length = source[i].length;
+			}
+			double build = SecondsSince(start);
+
+			start = BenchmarkClock::now();
+			pool.Release();
+			double teardown = SecondsSince(start);
+
+			poolRuns++;
+			poolBuild += build;
+			poolTeardown += teardown;
+			return build + teardown;
+		});
+
+		printf("  %d iterations, %zu bones\n", treeIterations, source.size());
+		printf("    %-28s build %8.3f ms  teardown %8.3f ms\n", "new + pointer links", linkedBuild / linkedRuns * 1000.0, linkedTeardown / linkedRuns * 1000.0);
+		printf("    %-28s build %8.3f ms  teardown %8.3f ms\n", "BonePool", poolBuild / poolRuns * 1000.0, poolTeardown / poolRuns * 1000.0);
+		PrintResult("new + pointer links", linkedSeconds, source.size(), linkedSeconds);
+		PrintResult("BonePool", poolSeconds, source.size(), linkedSeconds);
+	}
+}
+
+
+void BenchmarkSkeletonTraversal()
+{
+	using TBone = Bone<FractalTree3DProps>;
+
+	printf("\nSkeleton traversal, bone and normal segments (ForEachBone std::function vs FlatSkeleton)\n");
+	UniformRandomGenerator uniformGenerator;
+	const int subdivisions = 3;
+	SpeciesDescriptor species = FractalTree3DSpecies(TreeStyle::Default);
+	ParametricLSystem fractalTree = FractalTree3DParametricGrammar(species);
+	for (int treeIterations = 5; treeIterations <= 8; treeIterations++)
+	{
+		int grammarIterations = treeIterations * 2;
+		ModuleStream modules = fractalTree.RunProduction(grammarIterations);
+
+		Turtle3D<FractalTree3DProps> turtle;
+		turtle.GenerateSkeleton(modules, FractalTree3DActions{ species, uniformGenerator, grammarIterations, subdivisions });
+
+		FlatSkeleton skeleton;
+		double flattenSeconds = MeasureSeconds([&]() { turtle.Flatten(skeleton); });
+
+		std::vector<glm::fvec3> segments;
+		segments.reserve(skeleton.Size() * 4);
+		double functionSeconds = MeasureSeconds([&]()
+		{
+			segments.clear();
+			turtle.ForEachBone([&segments](TBone* b)
+			{
+				segments.push_back(b->transform.position);
+				segments.push_back(b->tipPosition());
+				segments.push_back(b->transform.position);
+				segments.push_back(b->transform.position + b->transform.up*0.2f);
+			});
+		});
+
+		double flatSeconds = MeasureSeconds([&]()
+		{
+			segments.clear();
+			for (uint32_t i = 0; i < uint32_t(skeleton.Size()); i++)
+			{
+				segments.push_back(skeleton.positions[i]);
+				segments.push_back(skeleton.TipPosition(i));
+				segments.push_back(skeleton.positions[i]);
+				segments.push_back(skeleton.positions[i] + skeleton.ups[i]*0.2f);
+			}
+		});
+
+		printf("  %d iterations, %zu bones\n", treeIterations, skeleton.Size());
+		PrintResult("ForEachBone std::function", functionSeconds, skeleton.Size(), functionSeconds);
+		PrintResult("FlatSkeleton", flatSeconds, skeleton.Size(), functionSeconds);
+		PrintResult("Flatten (once per skeleton)", flattenSeconds, skeleton.Size(), functionSeconds);
+	}
+}
+
+// Multi-million bone skeletons, including a single chain as deep as it is long and a root with millions of
+// children. Every stage loops over the pool or the flat arrays, so neither tree height nor sibling count touches
+// the call stack. The recursive LinkedBone destructor is not run here, it overflows the stack at these sizes.
+void BenchmarkSkeletonStress()
+{
+	using BenchmarkClock = std::chrono::high_resolution_clock;
+
+	auto runStages = [](const char* name, BonePool<FractalTree3DProps>& bones, double buildSeconds)
+	{
+		auto start = BenchmarkClock::now();
+		FlatSkeleton skeleton;
+		skeleton.Build(bones);
+		double flattenSeconds = SecondsSince(start);
+
+		start = BenchmarkClock::now();
+		BranchTable branches;
+		BuildBranchesForFractalTree3D(branches, bones);
+		double branchSeconds = SecondsSince(start);
+
+		start = BenchmarkClock::now();
+		uint32_t maxDepth = 0;
+		for (uint32_t i = 0; i < uint32_t(skeleton.Size()); i++)
+		{
+			maxDepth = std::max(maxDepth, uint32_t(skeleton.depths[i]));
+		}
+		double traverseSeconds = SecondsSince(start);
+
+		start = BenchmarkClock::now();
+		size_t boneCount = bones.Size();
+		size_t branchCount = branches.Size();
+		bones.Release();
+		skeleton.Clear();
+		branches = BranchTable{};
+		double teardownSeconds = SecondsSince(start);
+
+		printf("  %-24s %9zu bones, depth %9u, %8zu branches\n", name, boneCount, maxDepth, branchCount);
+		printf("    build %8.1f ms  flatten %7.1f ms  branches %7.1f ms  traverse %6.1f ms  teardown %6.1f ms\n",
+			buildSeconds * 1000.0, flattenSeconds * 1000.0, branchSeconds * 1000.0, traverseSeconds * 1000.0, teardownSeconds * 1000.0);
+	};
+
+	printf("\nSkeleton stress (multi-million bones, no recursion)\n");
+	for (int treeIterations = 9; treeIterations <= 10; treeIterations++)
+	{
+		const int subdivisions = 5;
+		auto start = BenchmarkClock::now();
+		TreeSkeleton tree = GenerateFractalTree3D(FractalTree3DSpecies(TreeStyle::Default).WithoutRandomness(), uint64_t(treeIterations), treeIterations, subdivisions);
+		double buildSeconds = SecondsSince(start);
+
+		char name[64];
+		snprintf(name, sizeof(name), "tree, %d iterations", treeIterations);
+		runStages(name, tree.bones, buildSeconds);
+	}
+
+	const uint32_t syntheticSize = 4 * 1024 * 1024;
+	{
+		BonePool<FractalTree3DProps> bones;
+		auto start = BenchmarkClock::now();
+		uint32_t tip = bones.NewRoot();
+		for (uint32_t i = 1; i < syntheticSize; i++)
+		{
+			tip = bones.NewChild(tip);
+			bones[tip].length = 1.0f;
+		}
+		runStages("single chain", bones, SecondsSince(start));
+	}
+	{
+		BonePool<FractalTree3DProps> bones;
+		auto start = BenchmarkClock::now();
+		uint32_t root = bones.NewRoot();
+		for (uint32_t i = 1; i < syntheticSize; i++)
+		{
+			bones[bones.NewChild(root)].length = 1.0f;
+		}
+		runStages("one root, all siblings", bones, SecondsSince(start));
+	}
+}
+
+void BenchmarkTurtleStateStack()
+{
+	using Turtle = Turtle3D<FractalTree3DProps>;
+	using TTransform = TurtleTransform<FractalTree3DProps>;
+
+	const int iterations = 14;
+	LSystemString lsystem = FractalTree3DGrammar(FractalTree3DSpecies(TreeStyle::Default));
+	std::string symbols = lsystem.RunProduction(iterations);
+	int maxBracketDepth = lsystem.MaxBracketDepth(iterations);
+	printf("\nTurtle state push/pop (two std::stacks vs one reserved stack), %zu symbols, bracket depth %d\n", symbols.size(), maxBracketDepth);
+
+	// The stacks as they were, recreated by every Clear
+	Turtle turtle;
+	std::stack<TTransform> transformStack;
+	std::stack<uint32_t> branchStack;
+	double stdStackSeconds = MeasureSeconds([&]()
+	{
+		transformStack = std::stack<TTransform>();
+		branchStack = std::stack<uint32_t>();
+		for (char c : symbols)
+		{
+			if (c == '[')
+			{
+				branchStack.push(turtle.activeBone);
+				transformStack.push(turtle.transform);
+			}
+			else if (c == ']')
+			{
+				turtle.transform = transformStack.top();
+				transformStack.pop();
+				turtle.activeBone = branchStack.top();
+				branchStack.pop();
+			}
+		}
+	});
+
+	turtle.ReserveStates(maxBracketDepth);
+	double reservedSeconds = MeasureSeconds([&]()
+	{
+		turtle.Clear();
+		for (char c : symbols)
+		{
+			if (c == '[') turtle.PushState();
+			else if (c == ']') turtle.PopState();
+		}
+	});
+
+	PrintResult("std::stack x2", stdStackSeconds, symbols.size(), stdStackSeconds);
+	PrintResult("reserved state stack", reservedSeconds, symbols.size(), stdStackSeconds);
+}
+
+void BenchmarkTurtleRotations()
+{
+	const int rotations = 1 << 20;
+
+	printf("\nTurtle roll + pitch (mat4 glm::rotate vs Rodrigues)\n");
+	UniformRandomGenerator uniformGenerator;
+	std::vector<glm::fvec2> angles(rotations);
+	for (auto& angle : angles)
+	{
+		angle = glm::fvec2{ uniformGenerator.RandomFloat(-180.0f, 180.0f), uniformGenerator.RandomFloat(-45.0f, 45.0f) };
+	}
+
+	TurtleTransform<FractalTree3DProps> matrixTransform;
+	double matrixSeconds = MeasureSeconds([&]()
+	{
+		matrixTransform.Clear();
+		for (const auto& angle : angles)
+		{
+			RotateWithMatrices(matrixTransform, angle.x, angle.y);
+		}
+	});
+
+	Turtle3D<FractalTree3DProps> turtle;
+	double rodriguesSeconds = MeasureSeconds([&]()
+	{
+		turtle.Clear();
+		for (const auto& angle : angles)
+		{
+			turtle.Rotate(angle.x, angle.y);
+		}
+	});
+
+	// Frames after a short chain, the length of a deep branch, and how far the two drift from orthonormal
+	const int chainLength = 64;
+	float maxDifference = 0.0f;
+	float matrixSkew = 0.0f;
+	float rodriguesSkew = 0.0f;
+	matrixTransform.Clear();
+	turtle.Clear();
+	for (int i = 0; i < rotations; i++)
+	{
+		if (i % chainLength == 0)
+		{
+			matrixTransform.Clear();
+			turtle.Clear();
+		}
+		RotateWithMatrices(matrixTransform, angles[i].x, angles[i].y);
+		turtle.Rotate(angles[i].x, angles[i].y);
+
+		maxDifference = glm::max(maxDifference, glm::length(matrixTransform.forward - turtle.transform.forward));
+		maxDifference = glm::max(maxDifference, glm::length(matrixTransform.up - turtle.transform.up));
+	}
+
+	matrixTransform.Clear();
+	turtle.Clear();
+	for (const auto& angle : angles)
+	{
+		RotateWithMatrices(matrixTransform, angle.x, angle.y);
+		turtle.Rotate(angle.x, angle.y);
+	}
+	auto skew = [](const TurtleTransform<FractalTree3DProps>& t)
+	{
+		return glm::abs(glm::dot(t.forward, t.up)) + glm::abs(glm::length(t.forward) - 1.0f) + glm::abs(glm::length(t.up) - 1.0f);
+	};
+	matrixSkew = skew(matrixTransform);
+	rodriguesSkew = skew(turtle.transform);
+
+	PrintResult("mat4 glm::rotate", matrixSeconds, rotations, matrixSeconds);
+	PrintResult("Rodrigues", rodriguesSeconds, rotations, matrixSeconds);
+	printf("    max frame difference over %d-rotation chains: %g\n", chainLength, maxDifference);
+	printf("    skew after %d rotations: mat4 %g, Rodrigues %g\n", rotations, matrixSkew, rodriguesSkew);
+}
+
+void BenchmarkTreeCache()
+{
+	// One quad per leaf, the meshes stay on the CPU
+	GLTriangleMesh leafMesh{ false };
+	leafMesh.AddVertex(glm::fvec3(-0.5f, 0.0f, 0.0f), glm::fvec3(0.0f, 0.0f, 1.0f), glm::fvec4(1.0f), glm::fvec4(0.0f, 0.0f, 0.0f, 0.0f));
+	leafMesh.AddVertex(glm::fvec3( 0.5f, 0.0f, 0.0f), glm::fvec3(0.0f, 0.0f, 1.0f), glm::fvec4(1.0f), glm::fvec4(1.0f, 0.0f, 0.0f, 0.0f));
+	leafMesh.AddVertex(glm::fvec3( 0.5f, 1.0f, 0.0f), glm::fvec3(0.0f, 0.0f, 1.0f), glm::fvec4(1.0f), glm::fvec4(1.0f, 1.0f, 0.0f, 0.0f));
+	leafMesh.AddVertex(glm::fvec3(-0.5f, 1.0f, 0.0f), glm::fvec3(0.0f, 0.0f, 1.0f), glm::fvec4(1.0f), glm::fvec4(0.0f, 1.0f, 0.0f, 0.0f));
+	leafMesh.DefineNewTriangle(0, 1, 2);
+	leafMesh.DefineNewTriangle(0, 2, 3);
+
+	TreeCache cache{ std::filesystem::temp_directory_path() / "tree_cache_benchmark" };
+	SpeciesDescriptor descriptor = FractalTree3DSpecies(TreeStyle::Default);
+	const uint64_t seed = 1;
+	const int subdivisions = 3;
+
+	printf("\nTree cache (generate and mesh vs save vs load of the same tree)\n");
+	for (int iterations = 3; iterations <= 6; iterations++)
+	{
+		TreeSkeleton tree;
+		GLTriangleMesh branchMeshes{ false };
+		GLTriangleMesh crownLeavesMeshes{ false };
+		double generateSeconds = MeasureSeconds([&]()
+		{
+			tree = GenerateTreeSkeleton(descriptor, seed, iterations, subdivisions);
+			MeshTree(tree, descriptor, branchMeshes, crownLeavesMeshes, leafMesh, seed, iterations, subdivisions);
+		});
+
+		TreeCacheKey key = MakeTreeCacheKey(descriptor, seed, iterations, subdivisions, nullptr, leafMesh);
+		double saveSeconds = MeasureSeconds([&]() { cache.Save(key, tree, branchMeshes, crownLeavesMeshes); });
+
+		TreeSkeleton loadedTree;
+		GLTriangleMesh loadedBranchMeshes{ false };
+		GLTriangleMesh loadedCrownLeavesMeshes{ false };
+		bool loaded = true;
+		double loadSeconds = MeasureSeconds([&]() { loaded = cache.Load(key, loadedTree, loadedBranchMeshes, loadedCrownLeavesMeshes) && loaded; });
+
+		bool identical = loaded && loadedTree.bones.Size() == tree.bones.Size()
+			&& loadedBranchMeshes.positions == branchMeshes.positions && loadedBranchMeshes.indices == branchMeshes.indices
+			&& loadedCrownLeavesMeshes.positions == crownLeavesMeshes.positions && loadedCrownLeavesMeshes.indices == crownLeavesMeshes.indices;
+
+		std::error_code error;
+		uint64_t fileBytes = std::filesystem::file_size(cache.PathFor(key), error);
+		uint64_t bones = uint64_t(tree.bones.Size());
+		printf("  %d iterations, %llu bones, %.1f KB file, roundtrip %s\n", iterations, (unsigned long long)bones,
+			fileBytes / 1024.0, identical ? "identical" : "DIFFERS");
+		printf("    %-28s %9.2f ms\n", "generate and mesh", generateSeconds * 1000.0);
+		printf("    %-28s %9.2f ms %6.2fx\n", "save", saveSeconds * 1000.0, generateSeconds / saveSeconds);
+		printf("    %-28s %9.2f ms %6.2fx\n", "load", loadSeconds * 1000.0, generateSeconds / loadSeconds);
+	}
+
+	std::error_code error;
+	std::filesystem::remove_all(cache.folder, error);
+}
+
+/*
+	Self tests
+*/
+// Polynomials over GF(2), one coefficient per entry, lowest power first
+using BitPolynomial = std::vector<uint8_t>;
+
+// Lowest bits of the next count outputs. The lowest bit of a sum is the xor of the lowest bits, so this
+// sequence is linear in the xorshift state and follows a linear recurrence of degree at most 128.
+std::vector<uint8_t> LowestOutputBits(UniformRandomGenerator generator, size_t count)
+{
+	std::vector<uint8_t> bits(count);
+	for (uint8_t& bit : bits)
+	{
+		bit = uint8_t(generator.RandomInt() & 1);
+	}
+	return bits;
+}
+
+// Berlekamp-Massey, returns the polynomial M of the shortest recurrence, i.e. x^L + c1 x^(L-1) + ... + cL
+// for bits[i] = c1 bits[i-1] ^ ... ^ cL bits[i-L]
+BitPolynomial MinimalPolynomial(const std::vector<uint8_t>& bits)
+{
+	size_t n = bits.size();
+	BitPolynomial c(n + 1, 0), b(n + 1, 0);
+	c[0] = b[0] = 1;
+	size_t length = 0;
+	size_t shift = 1;
+	for (size_t i = 0; i < n; i++)
+	{
+		uint8_t discrepancy = bits[i];
+		for (size_t j = 1; j <= length; j++)
+		{
+			discrepancy ^= c[j] & bits[i - j];
+		}
+
+		if (discrepancy == 0)
+		{
+			shift++;
+			continue;
+		}
+
+		BitPolynomial previous = c;
+		for (size_t j = 0; j + shift <= n; j++)
+		{
+			c[j + shift] ^= b[j];
+		}
+		if (2 * length <= i)
+		{
+			length = i + 1 - length;
+			b = previous;
+			shift = 1;
+		}
+		else
+		{
+			shift++;
+		}
+	}
+
+	BitPolynomial minimal(length + 1, 0);
+	for (size_t j = 0; j <= length; j++)
+	{
+		minimal[length - j] = c[j];
+	}
+	return minimal;
+}
+
+BitPolynomial MultiplyModulo(const BitPolynomial& a, const BitPolynomial& b, const BitPolynomial& modulus)
+{
+	size_t degree = modulus.size() - 1;
+	BitPolynomial product(2 * degree + 1, 0);
+	for (size_t i = 0; i < a.size(); i++)
+	{
+		for (size_t j = 0; a[i] && j < b.size(); j++)
+		{
+			product[i + j] ^= b[j];
+		}
+	}
+
+	for (size_t i = product.size(); i-- > degree;)
+	{
+		for (size_t j = 0; product[i] && j <= degree; j++)
+		{
+			product[i - degree + j] ^= modulus[j];
+		}
+	}
+	product.resize(degree);
+	return product;
+}
+
+// Predicts the lowest bits after advancing by the step whose x^step modulo the minimal polynomial is remainder:
+// since M divides x^step - remainder, bits[n + step] is the xor of bits[n + i] for every set coefficient i
+std::vector<uint8_t> PredictOutputBits(const std::vector<uint8_t>& bits, const BitPolynomial& remainder, size_t count)
+{
+	std::vector<uint8_t> predicted(count, 0);
+	for (size_t n = 0; n < count; n++)
+	{
+		for (size_t i = 0; i < remainder.size(); i++)
+		{
+			predicted[n] ^= remainder[i] & bits[n + i];
+		}
+	}
+	return predicted;
+}
+
+// Checks Jump against x^(2^64) computed from the recurrence of the output bits, the same arithmetic done
+// independently of the jump polynomial constants. A small step is checked against plain stepping first.
+void SelfTestGeneratorJump()
+{
+	const size_t bitCount = 512;
+	const size_t checkCount = 256;
+	bool passed = true;
+
+	for (uint64_t seed = 1; seed <= 4; seed++)
+	{
+		UniformRandomGenerator generator{ seed };
+		std::vector<uint8_t> bits = LowestOutputBits(generator, bitCount);
+		BitPolynomial minimal = MinimalPolynomial(bits);
+		size_t degree = minimal.size() - 1;
+		passed = passed && degree > 0 && degree <= 128;
+
+		BitPolynomial x(degree, 0);
+		x[1 % degree] = 1;
+
+		// x^1000 by square and multiply, against 1000 plain steps
+		BitPolynomial power(degree, 0);
+		power[0] = 1;
+		for (int bit = 9; bit >= 0; bit--)
+		{
+			power = MultiplyModulo(power, power, minimal);
+			if (1000 & (1 << bit))
+			{
+				power = MultiplyModulo(power, x, minimal);
+			}
+		}
+		UniformRandomGenerator stepped = generator;
+		for (int i = 0; i < 1000; i++)
+		{
+			stepped.RandomInt();
+		}
+		passed = passed && PredictOutputBits(bits, power, checkCount) == LowestOutputBits(stepped, checkCount);
+
+		// x^(2^64) by squaring x 64 times, against Jump
+		BitPolynomial jump = x;
+		for (int i = 0; i < 64; i++)
+		{
+			jump = MultiplyModulo(jump, jump, minimal);
+		}
+		UniformRandomGenerator jumped = generator;
+		jumped.Jump();
+		passed = passed && PredictOutputBits(bits, jump, checkCount) == LowestOutputBits(jumped, checkCount);
+
+		// Split hands out the current sequence and leaves the generator one jump ahead
+		UniformRandomGenerator split = generator;
+		UniformRandomGenerator stream = split.Split();
+		passed = passed && LowestOutputBits(stream, checkCount) == LowestOutputBits(generator, checkCount);
+		passed = passed && LowestOutputBits(split, checkCount) == LowestOutputBits(jumped, checkCount);
+	}
+
+	printf("\nUniformRandomGenerator::Jump against 2^64 steps of the output recurrence: %s\n", passed ? "passed" : "FAILED");
+}
+
+int main()
+{
+	printf("L-system benchmarks\n");
+
+	SelfTestGeneratorJump();
+	BenchmarkLSystemRules();
+	BenchmarkContextSensitive();
+	BenchmarkTurtleActions();
+	BenchmarkTurtleStateStack();
+	BenchmarkTurtleRotations();
+	BenchmarkParametricTree();
+	BenchmarkIterationScrubbing();
+	BenchmarkGrammarProgram();
+	BenchmarkTreeSkeleton();
+	BenchmarkBoneStorage();
+	BenchmarkSkeletonTraversal();
+	BenchmarkSkeletonStress();
+	BenchmarkTreeCache();
+
+	return 0;
+}
\ No newline at end of file
@@ -53,6 +53,52 @@ void DrawBresenhamLine(GLTexture& texture, float x1, float y1, float x2, float y
 	}
 }
 
+// Liang-Barsky clipping against the rectangle [minimum, maximum]. Returns false when nothing of the line is inside.
+// Lines that are already inside are left untouched, so they rasterize exactly as before.
+bool ClipLine(glm::fvec2& start, glm::fvec2& end, glm::fvec2 minimum, glm::fvec2 maximum)
+{
+	glm::fvec2 delta = end - start;
+	float t0 = 0.0f;
+	float t1 = 1.0f;
+
+	const float p[4] = { -delta.x, delta.x, -delta.y, delta.y };
+	const float q[4] = { start.x - minimum.x, maximum.x - start.x, start.y - minimum.y, maximum.y - start.y };
+	for (int i = 0; i < 4; i++)
+	{
+		if (p[i] == 0.0f)
+		{
+			if (q[i] < 0.0f)
+			{
+				return false;
+			}
+			continue;
+		}
+
+		float t = q[i] / p[i];
+		if (p[i] < 0.0f)
+		{
+			t0 = std::max(t0, t);
+		}
+		else
+		{
+			t1 = std::min(t1, t);
+		}
+
+		if (t0 > t1)
+		{
+			return false;
+		}
+	}
+
+	glm::fvec2 clippedStart = start + delta * t0;
+	if (t1 < 1.0f)
+	{
+		end = start + delta * t1;
+	}
+	start = clippedStart;
+	return true;
+}
+
 Canvas2D::Canvas2D()
 {
 	GLQuadProperties properties;
@@ -121,4 +167,21 @@ void Canvas2D::DrawLine(glm::fvec2 start, glm::fvec2 end, Color& color)
 {
 	bDirty = true;
 	DrawBresenhamLine(*texture, start.x, start.y, end.x, end.y, color);
-}
\ No newline at end of file
+}
+
+void Canvas2D::DrawLines(const std::vector<LineSegment2D>& segments)
+{
+	bDirty = true;
+	glm::fvec2 minimum{ 0.0f, 0.0f };
+	glm::fvec2 maximum{ float(texture->width), float(texture->height) };
+	for (const LineSegment2D& segment : segments)
+	{
+		glm::fvec2 start = segment.start;
+		glm::fvec2 end = segment.end;
+		if (ClipLine(start, end, minimum, maximum))
+		{
+			Color color = segment.color;
+			DrawBresenhamLine(*texture, start.x, start.y, end.x, end.y, color);
+		}
+	}
+}
@@ -4,6 +4,14 @@
 #include "texture.h"
 #include "mesh.h"
 #include "../core/math.h"
+#include <vector>
+
+struct LineSegment2D
+{
+	glm::fvec2 start;
+	glm::fvec2 end;
+	Color color;
+};
 
 class Canvas2D
 {
@@ -39,4 +47,7 @@ protected:
 public:
 	void Fill(Color& color);
 	void DrawLine(glm::fvec2 start, glm::fvec2 end, Color& color);
+
+	// Clips every segment to the texture first, so segments outside the canvas cost nothing to rasterize
+	void DrawLines(const std::vector<LineSegment2D>& segments);
 };
\ No newline at end of file
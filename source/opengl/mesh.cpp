@@ -25,14 +25,18 @@ glm::mat4 MeshTransform::ModelMatrix()
 }
 
 
-GLMeshInterface::GLMeshInterface()
+GLMeshInterface::GLMeshInterface(bool createVertexArray)
 {
+	if (!createVertexArray) return;
+
 	glGenVertexArrays(1, &vao);
 	glBindVertexArray(vao);
 }
 
 GLMeshInterface::~GLMeshInterface()
 {
+	if (vao == 0) return;
+
 	glBindVertexArray(0);
 	glDeleteVertexArrays(1, &vao);
 }
@@ -41,6 +45,7 @@ GLMeshInterface::~GLMeshInterface()
 
 
 GLTriangleMesh::GLTriangleMesh(bool allocate)
+	: GLMeshInterface(allocate)
 {
 	allocated = allocate;
 	if (!allocated) return;
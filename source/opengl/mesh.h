@@ -30,7 +30,7 @@ protected:
 public:
 	MeshTransform transform;
 
-	GLMeshInterface();
+	GLMeshInterface(bool createVertexArray = true); // without a vertex array the mesh only lives on the CPU
 	~GLMeshInterface();
 
 	// Behaves like glBufferData, but for std::vector<T>.
@@ -1,4 +1,5 @@
 #include "tree.h"
+#include "treecache.h"
 
 void GenerateLeaf(Canvas2D & leafCanvas, GLTriangleMesh& leafMesh)
 {
@@ -57,30 +58,129 @@ void GenerateLeaf(Canvas2D & leafCanvas, GLTriangleMesh& leafMesh)
 	leafMesh.SendToGPU();
 }
 
-void GenerateNewTree(TreeStyle style, GLLine& skeletonLines, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, UniformRandomGenerator& uniformGenerator, int treeIterations, int treeSubdivisions)
+// Leaves per branch segment and the chance to prune each one. Bigger trees get fewer leaves per bone and lose
+// more of them, MeshTree places them and EstimateNewTree counts them from the same numbers.
+struct LeafDensity
+{
+	float pruningChance = 0.0f;	// below 0 for small trees, then no leaf is removed
+	int leavesPerBranch = 1;
+};
+
+LeafDensity LeafDensityFor(const SpeciesDescriptor& descriptor, int treeIterations)
+{
+	LeafDensity density;
+	float growthCurve = treeIterations / (1.0f + float(treeIterations));
+	density.pruningChance = growthCurve * 2.0f - 1.0f;
+	density.leavesPerBranch = descriptor.leavesPerBone - int(descriptor.leafThinning * density.pruningChance);
+	density.leavesPerBranch = (density.leavesPerBranch == 0) ? 1 : density.leavesPerBranch;
+	return density;
+}
+
+TreeEstimate EstimateNewTree(const SpeciesDescriptor& descriptor, const GLTriangleMesh& leafMesh, int treeIterations, int treeSubdivisions, const GrammarProgram* species)
+{
+	TreeEstimate estimate;
+	if (species)
+	{
+		// Every forward command adds a bone, every bracket is counted as a branch (an upper bound)
+		ProductionEstimate production = species->lsystem.EstimateProduction(treeIterations);
+		for (int symbol = 0; symbol < 256; symbol++)
+		{
+			const GrammarProgram::InstructionRange& range = species->Find(char(symbol));
+			for (uint32_t i = range.first; i < range.first + range.count; i++)
+			{
+				estimate.bones += (species->instructions[i].opcode == TurtleOpcode::Forward) ? production.symbolCounts[symbol] : 0.0;
+			}
+		}
+		estimate.symbols = production.length;
+		estimate.branches = (estimate.bones > 0.0) ? 1.0 + production.Count('[') : 0.0;
+	}
+	else
+	{
+		// Mirrors the rules in GenerateFractalTree3D, every A or C action adds one bone per subdivision
+		// and every bracket that is expanded at least once more starts a new branch.
+		int iterations = treeIterations * 2;
+		treeSubdivisions = (treeSubdivisions == 0) ? 1 : treeSubdivisions;
+		LSystemString grammar = FractalTree3DGrammar(descriptor);
+		ProductionEstimate production = grammar.EstimateProduction(iterations);
+		ProductionEstimate branchingPoints = grammar.EstimateProduction(iterations - 1);
+
+		estimate.symbols = production.length;
+		estimate.bones = (production.Runs('A') + production.Runs('C')) * treeSubdivisions;
+		estimate.branches = (estimate.bones > 0.0) ? 1.0 + branchingPoints.Count('[') : 0.0;
+
+		// A FractalTree3DGrammarCache keeps the unmerged production of every iteration up to this one.
+		// A module stands for at least one symbol, so the symbol counts are an upper bound.
+		for (int i = 0; i <= iterations; i++)
+		{
+			estimate.cachedModules += (i == iterations) ? production.length : grammar.EstimateProduction(i).length;
+		}
+	}
+
+	const double ringDivisions = 6.0;
+	LeafDensity leafDensity = LeafDensityFor(descriptor, treeIterations);
+	double leafSurvival = (leafDensity.pruningChance > 0.0f) ? 1.0 - leafDensity.pruningChance : 1.0;
+
+	estimate.branchVertices = estimate.bones * (ringDivisions + 1.0) + estimate.branches;
+	estimate.branchTriangles = ringDivisions * (2.0 * estimate.bones - estimate.branches);
+
+	// Leaves grow on the outer three quarters of every branch, plus one at each tip
+	estimate.leaves = 0.75 * estimate.bones * leafDensity.leavesPerBranch * leafSurvival + estimate.branches;
+	estimate.leafTriangles = estimate.leaves * double(leafMesh.indices.size() / 3);
+
+	const double vertexBytes = double(sizeof(glm::fvec3) * 2 + sizeof(glm::fvec4) * 2);
+	const double triangleBytes = double(sizeof(unsigned int) * 3);
+	const double moduleBytes = double(sizeof(char) + sizeof(uint32_t) + sizeof(float) * 2);
+	const double skeletonLineBytes = double(sizeof(GLLineSegment) + sizeof(glm::fvec4) * 2);
+	double leafVertices = estimate.leaves * double(leafMesh.positions.size());
+
+	estimate.memoryBytes =
+		(estimate.symbols + estimate.cachedModules) * moduleBytes
+		+ estimate.bones * (sizeof(Bone<FractalTree3DProps>) + 2.0 * skeletonLineBytes)
+		+ (estimate.branchVertices + leafVertices) * vertexBytes
+		+ (estimate.branchTriangles + estimate.leafTriangles) * triangleBytes;
+
+	return estimate;
+}
+
+TreeSkeleton GenerateTreeSkeleton(const SpeciesDescriptor& descriptor, uint64_t seed, int treeIterations, int treeSubdivisions, const GrammarProgram* species, FractalTree3DGrammarCache* grammars)
+{
+	uint64_t skeletonSeed = HashCounter(seed, uint64_t(TreeStage::Skeleton), 0);
+	if (species)
+	{
+		uint64_t ruleSeed = HashCounter(seed, uint64_t(TreeStage::Rules), species->lsystem.seed);
+		return GenerateFractalTree3D(*species, skeletonSeed, ruleSeed, treeIterations);
+	}
+
+	return GenerateFractalTree3D(
+		descriptor,
+		skeletonSeed,
+		treeIterations,
+		treeSubdivisions,
+		grammars
+	);
+}
+
+void MeshTree(const TreeSkeleton& tree, const SpeciesDescriptor& descriptor, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, uint64_t seed, int treeIterations, int treeSubdivisions)
 {
-	skeletonLines.Clear();
 	branchMeshes.Clear();
 	crownLeavesMeshes.Clear();
 
 	/*
 		Tree branch propertes
 	*/
-	float trunkThickness = 0.5f * powf(1.3f, float(treeIterations));
-	float branchScalar = 0.4f;											// how the branch thickness relates to the parent
-	float depthScalar = powf(0.75f, 1.0f / float(treeSubdivisions));	// how much the branch shrinks in thickness the farther from the root it goes (the pow is to counter the subdiv growth)
-	const int trunkCylinderDivisions = 32;
+	float trunkThickness = descriptor.trunkThickness * powf(descriptor.trunkThicknessGrowth, float(treeIterations));
+	float branchScalar = descriptor.branchThickness;										// how the branch thickness relates to the parent
+	float depthScalar = powf(descriptor.depthThinning, 1.0f / float(treeSubdivisions));	// how much the branch shrinks in thickness the farther from the root it goes (the pow is to counter the subdiv growth)
+	const int trunkCylinderDivisions = descriptor.trunkCylinderDivisions;
 
 	/*
 		Leaf generation properties
 	*/
-	float leafMinScale = 0.25f;
-	float leafMaxScale = 1.5f;
-	float growthCurve = treeIterations / (1.0f + float(treeIterations));
-	float pruningChance = growthCurve * 2.0f - 1.0f;// Random chance to remove a leaf (chance increases by the number of iterations)
-
-	int leavesPerBranch = 25 - int(20 * (growthCurve * 2.0f - 1.0f));
-	leavesPerBranch = (leavesPerBranch == 0) ? 1 : leavesPerBranch;
+	float leafMinScale = descriptor.leafScale.min;
+	float leafMaxScale = descriptor.leafScale.max;
+	LeafDensity leafDensity = LeafDensityFor(descriptor, treeIterations);
+	float pruningChance = leafDensity.pruningChance; // Random chance to remove a leaf (chance increases by the number of iterations)
+	int leavesPerBranch = leafDensity.leavesPerBranch;
 
 
 
@@ -98,223 +198,238 @@ void GenerateNewTree(TreeStyle style, GLLine& skeletonLines, GLTriangleMesh& bra
 		return (cylinderDivisions < 4) ? 6 : cylinderDivisions;
 	};
 
-	int branchCount = 0;
-	GenerateFractalTree3D(
-		style,
-		uniformGenerator,
-		treeIterations,
-		treeSubdivisions,
-		true,
-		[&](Bone<FractalTree3DProps>* root, std::vector<FractalBranch>& branches) -> void
+	if (tree.Empty()) return;
+	const BranchTable& branches = tree.branches;
+
+	// Meshing and leaf placement read the bone attributes from the flat arrays, indexed by the branch table
+	FlatSkeleton skeleton;
+	skeleton.Build(tree.bones);
+
+	for (size_t b = 0; b < branches.Size(); b++)
 	{
-		if (!root) return;
-		using TBone = Bone<FractalTree3DProps>;
+		int branchDepth = branches.depths[b];
+		int cylinderDivisions = getCylinderDivisions(branchDepth);
+		GLTriangleMesh newBranchMesh{ false };
 
-		for (int b = 0; b < branches.size(); b++)
+		/*
+			Vertex
+			Positions, Normals, Texture Coordinates
+		*/
+		// Create vertex rings around each bone
+		const uint32_t* branchBones = branches.Bones(b);
+		int branchLength = branches.BoneCount(b);
+		uint32_t parent = skeleton.parents[branchBones[0]];
+		float texU = 0.0f; // Texture coordinate along branch, it varies depending on the bone length and must be tracked
+		for (int depth = 0; depth < branchLength; depth++)
 		{
-			int cylinderDivisions = getCylinderDivisions(branches[b].depth);
-			GLTriangleMesh newBranchMesh{ false };
-
-			/*
-				Vertex
-				Positions, Normals, Texture Coordinates
-			*/
-			// Create vertex rings around each bone
-			auto& branchNodes = branches[b].nodes;
-			float rootLength = branchNodes[0]->length;
-			float texU = 0.0f; // Texture coordinate along branch, it varies depending on the bone length and must be tracked
-			for (int depth = 0; depth < branchNodes.size(); depth++)
+			uint32_t bone = branchBones[depth];
+			float thickness = getBranchThickness(branchDepth, skeleton.depths[bone]);
+			float circumference = 2.0f*PI_f*thickness;
+			texU += skeleton.lengths[bone] / circumference;
+
+			glm::fvec3 localX = skeleton.ups[bone];
+			glm::fvec3 localY = skeleton.forwards[bone];
+
+			// Make the branch root blend into its parent a bit. (this makes the branches appear less angular)
+			glm::fvec3 position = skeleton.positions[bone];
+			if (depth < (treeSubdivisions - 1) && parent != FlatSkeleton::None)
 			{
-				auto& bone = branchNodes[depth];
-				float thickness = getBranchThickness(branches[b].depth, bone->nodeDepth);
-				float circumference = 2.0f*PI_f*thickness;
-				texU += bone->length / circumference;
-
-				skeletonLines.AddLine(bone->transform.position, bone->tipPosition(), glm::fvec4(0.0f, 1.0f, 0.0f, 1.0f));
-				skeletonLines.AddLine(bone->transform.position, bone->transform.position+bone->transform.up*0.2f, glm::fvec4(1.0f, 0.0f, 0.0f, 1.0f));
-
-				glm::fvec3 localX = bone->transform.up;
-				glm::fvec3 localY = bone->transform.forward;
-
-				// Make the branch root blend into its parent a bit. (this makes the branches appear less angular)
-				auto& t = bone->transform;
-				glm::fvec3 position = t.position;
-				if (depth < (treeSubdivisions - 1) && branchNodes[0]->parent)
-				{
-					auto& parent = branchNodes[0]->parent;
-					float blendAlpha = depth / float(treeSubdivisions);
-
-					glm::fvec3 u = parent->transform.forward;
-					glm::fvec3 v = bone->transform.position - parent->transform.position;
-					float length = glm::length(v);
-					v /= length;
-					glm::fvec3 projectionOnParent = parent->transform.position + glm::dot(u, v) * u * length * blendAlpha;
-
-					position = glm::mix(projectionOnParent, t.position, 0.5f + 0.5f*blendAlpha);
-					thickness = glm::mix(thickness / branchScalar, thickness, 0.4f + 0.6f*blendAlpha);
-
-					// Blend orientation of cylinder ring to give a spline
-					auto& parentForward = parent->transform.forward;
-					auto& boneForward = bone->transform.forward;
-					localY = glm::normalize(glm::mix(parentForward, boneForward, blendAlpha));
-					glm::fvec3 rotationVector = glm::normalize(glm::cross(boneForward, localY));
-					float angle = glm::acos(glm::dot(boneForward, localY));
-					localX = glm::rotate(glm::mat4(1.0f), angle, rotationVector) * glm::fvec4(localX, 0.0f);
-				}
-
-				// Generate the cylinder ring
-				float angleStep = 360.0f / float(cylinderDivisions);
-				for (int i = 0; i < cylinderDivisions; i++)
-				{
-					float angle = angleStep * i;
-					glm::mat4 rot = glm::rotate(glm::mat4{ 1.0f }, glm::radians(angle), localY);
-					glm::fvec3 normal = rot * glm::fvec4(localX, 0.0f);
-
-					newBranchMesh.AddVertex(
-						position + normal * thickness,
-						normal,
-						glm::fvec4{ 1.0f },
-						glm::fvec4{ texU, i / float(cylinderDivisions), 1.0f, 1.0f }
-					);
-				}
-
-				// Add extra set of vertices for the UV seam
+				float blendAlpha = depth / float(treeSubdivisions);
+
+				glm::fvec3 u = skeleton.forwards[parent];
+				glm::fvec3 v = skeleton.positions[bone] - skeleton.positions[parent];
+				float length = glm::length(v);
+				v /= length;
+				glm::fvec3 projectionOnParent = skeleton.positions[parent] + glm::dot(u, v) * u * length * blendAlpha;
+
+				position = glm::mix(projectionOnParent, skeleton.positions[bone], 0.5f + 0.5f*blendAlpha);
+				thickness = glm::mix(thickness / branchScalar, thickness, 0.4f + 0.6f*blendAlpha);
+
+				// Blend orientation of cylinder ring to give a spline
+				const glm::fvec3& parentForward = skeleton.forwards[parent];
+				const glm::fvec3& boneForward = skeleton.forwards[bone];
+				localY = glm::normalize(glm::mix(parentForward, boneForward, blendAlpha));
+				glm::fvec3 rotationVector = glm::normalize(glm::cross(boneForward, localY));
+				float angle = glm::acos(glm::dot(boneForward, localY));
+				localX = glm::rotate(glm::mat4(1.0f), angle, rotationVector) * glm::fvec4(localX, 0.0f);
+			}
+
+			// Generate the cylinder ring
+			float angleStep = 360.0f / float(cylinderDivisions);
+			for (int i = 0; i < cylinderDivisions; i++)
+			{
+				float angle = angleStep * i;
+				glm::mat4 rot = glm::rotate(glm::mat4{ 1.0f }, glm::radians(angle), localY);
+				glm::fvec3 normal = rot * glm::fvec4(localX, 0.0f);
+
 				newBranchMesh.AddVertex(
-					position + localX * thickness,
-					localX,
+					position + normal * thickness,
+					normal,
 					glm::fvec4{ 1.0f },
-					glm::fvec4{ texU, 1.0f, 1.0f, 1.0f }
+					glm::fvec4{ texU, i / float(cylinderDivisions), 1.0f, 1.0f }
 				);
 			}
 
-			// Add tip for branch
-			auto& lastBone = branchNodes.back();
+			// Add extra set of vertices for the UV seam
 			newBranchMesh.AddVertex(
-				lastBone->tipPosition(),
-				lastBone->transform.forward,
+				position + localX * thickness,
+				localX,
 				glm::fvec4{ 1.0f },
-				glm::fvec4{ texU + lastBone->length, 0.5f, 1.0f, 1.0f }
+				glm::fvec4{ texU, 1.0f, 1.0f, 1.0f }
 			);
+		}
 
+		// Add tip for branch
+		uint32_t lastBone = branchBones[branchLength - 1];
+		newBranchMesh.AddVertex(
+			skeleton.TipPosition(lastBone),
+			skeleton.forwards[lastBone],
+			glm::fvec4{ 1.0f },
+			glm::fvec4{ texU + skeleton.lengths[lastBone], 0.5f, 1.0f, 1.0f }
+		);
 
 
-			/*
-				Triangle Indices
-			*/
-			// Generate indices for cylinders
-			int ringStep = cylinderDivisions + 1; // +1 because of UV seam
-			for (int depth = 1; depth < branchNodes.size(); depth++)
-			{
-				int uStart = depth * ringStep;
-				int lStart = uStart - ringStep;
-
-				for (int i = 0; i < cylinderDivisions; i++)
-				{
-					int u = uStart + i;
-					int l = lStart + i;
 
-					newBranchMesh.DefineNewTriangle(l, l + 1, u + 1);
-					newBranchMesh.DefineNewTriangle(u + 1, u, l);
-				}
-			}
+		/*
+			Triangle Indices
+		*/
+		// Generate indices for cylinders
+		int ringStep = cylinderDivisions + 1; // +1 because of UV seam
+		for (int depth = 1; depth < branchLength; depth++)
+		{
+			int uStart = depth * ringStep;
+			int lStart = uStart - ringStep;
 
-			// Generate indices for tip
-			int tipIndex = int(newBranchMesh.positions.size()) - 1;
-			int lastRing = ringStep * (int(branchNodes.size()) - 1);
-			for (int i = 1; i < ringStep; i++)
+			for (int i = 0; i < cylinderDivisions; i++)
 			{
-				int ringId = lastRing + i;
-				newBranchMesh.DefineNewTriangle(ringId - 1, ringId, tipIndex);
+				int u = uStart + i;
+				int l = lStart + i;
+
+				newBranchMesh.DefineNewTriangle(l, l + 1, u + 1);
+				newBranchMesh.DefineNewTriangle(u + 1, u, l);
 			}
+		}
 
-			branchMeshes.AppendMesh(newBranchMesh);
+		// Generate indices for tip
+		int tipIndex = int(newBranchMesh.positions.size()) - 1;
+		int lastRing = ringStep * (branchLength - 1);
+		for (int i = 1; i < ringStep; i++)
+		{
+			int ringId = lastRing + i;
+			newBranchMesh.DefineNewTriangle(ringId - 1, ringId, tipIndex);
 		}
 
+		branchMeshes.AppendMesh(newBranchMesh);
+	}
 
 
 
-		/*
-			Generate leaves
-		*/
-		int maxBranchDepth = 0;
-		for (auto& branch : branches)
-		{
-			maxBranchDepth = (branch.depth > maxBranchDepth) ? branch.depth : maxBranchDepth;
-		}
 
-		int startDepth = maxBranchDepth - 2;
-		startDepth = (startDepth > 2) ? startDepth : 2;
+	/*
+		Generate leaves
+	*/
+	int maxBranchDepth = 0;
+	for (int branchDepth : branches.depths)
+	{
+		maxBranchDepth = (branchDepth > maxBranchDepth) ? branchDepth : maxBranchDepth;
+	}
 
-		for (auto& branch : branches)
+	int startDepth = maxBranchDepth - 2;
+	startDepth = (startDepth > 2) ? startDepth : 2;
+
+	for (size_t b = 0; b < branches.Size(); b++)
+	{
+		int branchDepth = branches.depths[b];
+		if (branchDepth < startDepth) continue;
+
+		// Each branch scatters its leaves from its own substream, so no branch depends on the ones before it
+		UniformRandomGenerator uniformGenerator = UniformRandomGenerator::Substream(seed, uint64_t(TreeStage::Leaves), b);
+
+		const uint32_t* branchBones = branches.Bones(b);
+		int lastIndex = branches.BoneCount(b) - 1;
+		int startIndex = int(round(0.25f * lastIndex));
+		for (int i = startIndex; i <= lastIndex; ++i)
 		{
-			if (branch.depth < startDepth) continue;
+			uint32_t leafNode = branchBones[i];
+
+			glm::fvec3 nodeBegin = skeleton.positions[leafNode];
+			glm::fvec3 nodeEnd = skeleton.TipPosition(leafNode);
+			glm::fvec3 nodeDirection = skeleton.forwards[leafNode];
+			glm::fvec3 nodeNormal = skeleton.ups[leafNode];
+
+			float thickness = getBranchThickness(branchDepth, skeleton.depths[leafNode]);
+			float circumference = 2.0f*PI_f*thickness;
 
-			auto& branchNodes = branch.nodes;
-			int lastIndex = int(branchNodes.size() - 1);
-			int startIndex = int(round(0.25f * lastIndex));
-			for (int i = startIndex; i <= lastIndex; ++i)
+			int leafId = leavesPerBranch;
+			float stepSize = skeleton.lengths[leafNode] / leavesPerBranch;
+			glm::fvec3 position, direction, normal;
+			while (leafId > 0)
 			{
-				auto& leafNode = branchNodes[i];
-
-				glm::fvec3 nodeBegin = leafNode->transform.position;
-				glm::fvec3 nodeEnd = leafNode->tipPosition();
-				glm::fvec3 nodeDirection = leafNode->transform.forward;
-				glm::fvec3 nodeNormal = leafNode->transform.up;
-
-				float thickness = getBranchThickness(branch.depth, leafNode->nodeDepth);
-				float circumference = 2.0f*PI_f*thickness;
-
-				int leafId = leavesPerBranch;
-				float stepSize = leafNode->length / leavesPerBranch;
-				glm::fvec3 position, direction, normal;
-				while (leafId > 0)
-				{
-					leafId--;
-					if (uniformGenerator.RandomFloat() < pruningChance) continue;
-
-					// Compute the leaf placement
-					position = nodeBegin + nodeDirection * (stepSize*leafId + uniformGenerator.RandomFloat(0.0f, stepSize / 2.0f));	// spread along branch
-					float angle = uniformGenerator.RandomFloat(0.0f, 2.0f*PI_f);
-					direction = glm::rotate(glm::mat4{ 1.0f }, angle, nodeDirection) * glm::fvec4{ nodeNormal, 1.0f };				// random direction
-					position += direction * thickness;																				// push leaf so that it starts on the branch and not inside it
-					direction = glm::normalize(glm::mix(direction, nodeDirection, uniformGenerator.RandomFloat(0.3f, 0.8f)));		// blend how much the leaf is angled along the branch
-					angle = uniformGenerator.RandomFloat(0.0f, 22.0f* PI_f);
-					normal = glm::rotate(glm::mat4{ 1.0f }, angle, direction) * glm::fvec4{ nodeDirection, 1.0f };					// random twist
-
-					// Insert the leaf
-					crownLeavesMeshes.AppendMeshTransformed(
-						leafMesh,
-						glm::inverse(glm::lookAt(position, position - direction, -normal)) * glm::scale(glm::mat4{ 1.0f }, glm::fvec3{ uniformGenerator.RandomFloat(leafMinScale, leafMaxScale) })
-					);
-				}
-
-				// Put a leaf at the tip of the branch
-				if (i == lastIndex)
-				{
-					crownLeavesMeshes.AppendMeshTransformed(
-						leafMesh,
-						glm::inverse(glm::lookAt(nodeEnd, nodeEnd - nodeDirection, -nodeNormal)) * glm::scale(glm::mat4{ 1.0f }, glm::fvec3{ uniformGenerator.RandomFloat(leafMinScale, leafMaxScale) })
-					);
-				}
-
-				// Debug orientation lines
-				//skeletonLines.AddLine(nodeEnd, nodeEnd + 0.2f*nodeDirection, glm::fvec4(0.0f, 1.0f, 0.0f, 1.0f));
-				//skeletonLines.AddLine(nodeEnd, nodeEnd + 0.2f*nodeNormal, glm::fvec4(1.0f, 0.0f, 0.0f, 1.0f));
+				leafId--;
+				if (uniformGenerator.RandomFloat() < pruningChance) continue;
+
+				// Compute the leaf placement
+				position = nodeBegin + nodeDirection * (stepSize*leafId + uniformGenerator.RandomFloat(0.0f, stepSize / 2.0f));	// spread along branch
+				float angle = uniformGenerator.RandomFloat(0.0f, 2.0f*PI_f);
+				direction = glm::rotate(glm::mat4{ 1.0f }, angle, nodeDirection) * glm::fvec4{ nodeNormal, 1.0f };				// random direction
+				position += direction * thickness;																				// push leaf so that it starts on the branch and not inside it
+				direction = glm::normalize(glm::mix(direction, nodeDirection, uniformGenerator.RandomFloat(0.3f, 0.8f)));		// blend how much the leaf is angled along the branch
+				angle = uniformGenerator.RandomFloat(0.0f, 22.0f* PI_f);
+				normal = glm::rotate(glm::mat4{ 1.0f }, angle, direction) * glm::fvec4{ nodeDirection, 1.0f };					// random twist
+
+				// Insert the leaf
+				crownLeavesMeshes.AppendMeshTransformed(
+					leafMesh,
+					glm::inverse(glm::lookAt(position, position - direction, -normal)) * glm::scale(glm::mat4{ 1.0f }, glm::fvec3{ uniformGenerator.RandomFloat(leafMinScale, leafMaxScale) })
+				);
+			}
+
+			// Put a leaf at the tip of the branch
+			if (i == lastIndex)
+			{
+				crownLeavesMeshes.AppendMeshTransformed(
+					leafMesh,
+					glm::inverse(glm::lookAt(nodeEnd, nodeEnd - nodeDirection, -nodeNormal)) * glm::scale(glm::mat4{ 1.0f }, glm::fvec3{ uniformGenerator.RandomFloat(leafMinScale, leafMaxScale) })
+				);
 			}
 
+			// Debug orientation lines
+			//skeletonLines.AddLine(nodeEnd, nodeEnd + 0.2f*nodeDirection, glm::fvec4(0.0f, 1.0f, 0.0f, 1.0f));
+			//skeletonLines.AddLine(nodeEnd, nodeEnd + 0.2f*nodeNormal, glm::fvec4(1.0f, 0.0f, 0.0f, 1.0f));
 		}
 
-		branchCount = int(branches.size());
-	});
+	}
+}
+
+void GenerateNewTree(const SpeciesDescriptor& descriptor, GLLine& skeletonLines, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, uint64_t seed, int treeIterations, int treeSubdivisions, const GrammarProgram* species, TreeCache* cache, FractalTree3DGrammarCache* grammars)
+{
+	TreeCacheKey key = MakeTreeCacheKey(descriptor, seed, treeIterations, treeSubdivisions, species, leafMesh);
+	TreeSkeleton tree;
+	bool fromCache = cache && cache->Load(key, tree, branchMeshes, crownLeavesMeshes);
+	if (!fromCache)
+	{
+		tree = GenerateTreeSkeleton(descriptor, seed, treeIterations, treeSubdivisions, species, grammars);
+		MeshTree(tree, descriptor, branchMeshes, crownLeavesMeshes, leafMesh, seed, treeIterations, treeSubdivisions);
+		if (cache)
+		{
+			cache->Save(key, tree, branchMeshes, crownLeavesMeshes);
+		}
+	}
+
+	// The debug lines are cheap to rebuild from the skeleton, so they are not cached
+	skeletonLines.Clear();
+	FlatSkeleton skeleton;
+	skeleton.Build(tree.bones);
+	skeleton.ToGLLines(skeletonLines, glm::fvec4(0.0f, 1.0f, 0.0f, 1.0f), glm::fvec4(1.0f, 0.0f, 0.0f, 1.0f));
 
 	branchMeshes.SendToGPU();
 	crownLeavesMeshes.SendToGPU();
 	skeletonLines.SendToGPU();
 
+	int branchCount = int(tree.branches.Size());
 	int branchPolycount = int(branchMeshes.indices.size() / 3);
 	int leavesPolycount = int(crownLeavesMeshes.indices.size() / 3);
 	int leafPolycount = int(leafMesh.indices.size() / 3);
 	int numLeaves = leavesPolycount / leafPolycount;
-	printf("Done! %d branches (%d triangles), %d leaves (%d triangles)", branchCount, branchPolycount, numLeaves, leavesPolycount);
+	printf("Done%s! %d branches (%d triangles), %d leaves (%d triangles)", fromCache ? " (from cache)" : "", branchCount, branchPolycount, numLeaves, leavesPolycount);
 }
-
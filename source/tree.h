@@ -1,5 +1,47 @@
+#pragma once
 #include "generation/fractals.h"
 
 void GenerateLeaf(Canvas2D& leafCanvas, GLTriangleMesh& leafMesh);
 
-void GenerateNewTree(TreeStyle style, GLLine& skeletonLines, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, UniformRandomGenerator& uniformGenerator, int treeIterations = 10, int treeSubdivisions = 3);
\ No newline at end of file
+// Predicted size of a tree from GenerateNewTree, computed from the L-system rules before anything is allocated.
+// Bone and branch counts follow the grammar exactly (expected values), mesh sizes assume the six sided
+// rings of the thin branches that make up almost every bone.
+struct TreeEstimate
+{
+	double symbols = 0.0;
+	double bones = 0.0;
+	double branches = 0.0;
+	double branchVertices = 0.0;
+	double branchTriangles = 0.0;
+	double leaves = 0.0;
+	double leafTriangles = 0.0;
+	double cachedModules = 0.0;	// grammar productions a FractalTree3DGrammarCache keeps, every iteration up to this one
+	double memoryBytes = 0.0;
+};
+
+TreeEstimate EstimateNewTree(const SpeciesDescriptor& descriptor, const GLTriangleMesh& leafMesh, int treeIterations = 10, int treeSubdivisions = 3, const GrammarProgram* species = nullptr);
+
+// Every random choice of a tree comes from one 64-bit seed, the same seed, species, iterations and subdivisions
+// always give the same meshes. Each stage draws from its own substream of the seed, so a stage can be rerun
+// (or skipped because its result is cached) without shifting the random numbers of the other stages.
+enum class TreeStage : uint64_t
+{
+	Skeleton = 1,
+	Leaves = 2,
+	Rules = 3 // which rule alternatives a GrammarProgram species picks, mixed with the seed of the grammar file
+};
+
+// Part of every TreeCache key. Increase it whenever a change to generation or meshing changes the output
+// for the same parameters, the old cache files then stop matching.
+constexpr uint32_t TreeGeneratorVersion = 2;
+
+class TreeCache;
+
+// The two stages of GenerateNewTree. The skeleton does not depend on the meshes, so it can be kept and meshed
+// again, and MeshTree only fills the CPU side of the meshes, SendToGPU is left to the caller.
+TreeSkeleton GenerateTreeSkeleton(const SpeciesDescriptor& descriptor, uint64_t seed, int treeIterations = 10, int treeSubdivisions = 3, const GrammarProgram* species = nullptr, FractalTree3DGrammarCache* grammars = nullptr);
+void MeshTree(const TreeSkeleton& tree, const SpeciesDescriptor& descriptor, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, uint64_t seed, int treeIterations = 10, int treeSubdivisions = 3);
+
+// Serves the tree from the cache when one is given and it holds these parameters, otherwise generates it and
+// stores the result there. grammars keeps the expanded grammar between trees, see EstimateNewTree for its size.
+void GenerateNewTree(const SpeciesDescriptor& descriptor, GLLine& skeletonLines, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes, const GLTriangleMesh& leafMesh, uint64_t seed, int treeIterations = 10, int treeSubdivisions = 3, const GrammarProgram* species = nullptr, TreeCache* cache = nullptr, FractalTree3DGrammarCache* grammars = nullptr);
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "treecache.h"
+#include "core/mappedfile.h"
+#include <fstream>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
+
+/*
+	File layout
+	TreeCacheHeader, one TreeCacheSection per array, then the arrays in the order of ForEachCachedArray.
+	Every array starts at a multiple of TreeCacheAlignment bytes.
+*/
+struct TreeCacheHeader
+{
+	char magic[8];
+	uint32_t formatVersion;
+	uint32_t sectionCount;
+	TreeCacheKey key;
+	uint64_t payloadHash;	// HashBytes over the arrays in file order, each chained into the next
+};
+
+struct TreeCacheSection
+{
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+const char TreeCacheMagic[8] = { 'T', 'R', 'E', 'E', 'C', 'A', 'C', 'H' };
+const uint32_t TreeCacheFormatVersion = 3;
+const uint64_t TreeCacheAlignment = 16;
+
+uint64_t AlignCacheOffset(uint64_t offset)
+{
+	return (offset + TreeCacheAlignment - 1) / TreeCacheAlignment * TreeCacheAlignment;
+}
+
+// Calls visit(array) for every cached array, in file order. Save and Load both go through here,
+// so the two can not disagree on the layout.
+template<class Skeleton, class Mesh, class Visitor>
+void ForEachCachedArray(Skeleton& tree, Mesh& branchMeshes, Mesh& crownLeavesMeshes, Visitor&& visit)
+{
+	visit(tree.bones.storage);
+	visit(tree.branches.boneIndices);
+	visit(tree.branches.offsets);
+	visit(tree.branches.depths);
+	visit(tree.branches.parentBranches);
+
+	for (Mesh* mesh : { &branchMeshes, &crownLeavesMeshes })
+	{
+		visit(mesh->positions);
+		visit(mesh->normals);
+		visit(mesh->colors);
+		visit(mesh->texCoords);
+		visit(mesh->indices);
+	}
+}
+
+/*
+	TreeCacheKey
+*/
+uint64_t TreeCacheKey::Hash() const
+{
+	static_assert(sizeof(TreeCacheKey) == 4 * sizeof(uint32_t) + 4 * sizeof(uint64_t), "TreeCacheKey must not contain padding");
+	return HashBytes(this, sizeof(TreeCacheKey));
+}
+
+bool TreeCacheKey::operator==(const TreeCacheKey& other) const
+{
+	return std::memcmp(this, &other, sizeof(TreeCacheKey)) == 0;
+}
+
+TreeCacheKey MakeTreeCacheKey(const SpeciesDescriptor& descriptor, uint64_t seed, int treeIterations, int treeSubdivisions, const GrammarProgram* species, const GLTriangleMesh& leafMesh)
+{
+	TreeCacheKey key;
+	key.iterations = treeIterations;
+	key.subdivisions = treeSubdivisions;
+	key.seed = seed;
+	key.descriptorHash = descriptor.Hash();
+	key.speciesHash = species ? species->sourceHash : 0;
+
+	uint64_t leafHash = HashBytes(leafMesh.positions.data(), leafMesh.positions.size() * sizeof(glm::fvec3));
+	leafHash = HashBytes(leafMesh.normals.data(), leafMesh.normals.size() * sizeof(glm::fvec3), leafHash);
+	leafHash = HashBytes(leafMesh.texCoords.data(), leafMesh.texCoords.size() * sizeof(glm::fvec4), leafHash);
+	key.leafMeshHash = HashBytes(leafMesh.indices.data(), leafMesh.indices.size() * sizeof(unsigned int), leafHash);
+	return key;
+}
+
+/*
+	TreeCache
+*/
+TreeCache::TreeCache(std::filesystem::path cacheFolder)
+	: folder{ cacheFolder }
+{
+}
+
+std::filesystem::path TreeCache::PathFor(const TreeCacheKey& key) const
+{
+	char filename[32];
+	snprintf(filename, sizeof(filename), "%016llx.tree", (unsigned long long)key.Hash());
+	return folder / filename;
+}
+
+bool TreeCache::Load(const TreeCacheKey& key, TreeSkeleton& tree, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes) const
+{
+	MappedFile file;
+	if (!file.Open(PathFor(key)))
+	{
+		return false;
+	}
+
+	uint32_t sectionCount = 0;
+	ForEachCachedArray(tree, branchMeshes, crownLeavesMeshes, [&](auto&) { sectionCount++; });
+
+	uint64_t tableEnd = sizeof(TreeCacheHeader) + sectionCount * sizeof(TreeCacheSection);
+	if (file.Size() < tableEnd)
+	{
+		return false;
+	}
+
+	TreeCacheHeader header;
+	std::memcpy(&header, file.Data(), sizeof(TreeCacheHeader));
+	if (std::memcmp(header.magic, TreeCacheMagic, sizeof(TreeCacheMagic)) != 0 || header.formatVersion != TreeCacheFormatVersion
+		|| header.sectionCount != sectionCount || !(header.key == key))
+	{
+		return false;
+	}
+
+	std::vector<TreeCacheSection> sections(sectionCount);
+	std::memcpy(sections.data(), file.Data() + sizeof(TreeCacheHeader), sectionCount * sizeof(TreeCacheSection));
+
+	// Check every section before anything is overwritten, a truncated file leaves the outputs untouched
+	bool valid = true;
+	size_t s = 0;
+	ForEachCachedArray(tree, branchMeshes, crownLeavesMeshes, [&](auto& array)
+	{
+		using Element = typename std::decay_t<decltype(array)>::value_type;
+		const TreeCacheSection& section = sections[s++];
+		valid = valid && section.offset >= tableEnd && section.offset <= file.Size()
+			&& section.bytes <= file.Size() - section.offset && section.bytes % sizeof(Element) == 0;
+	});
+	if (!valid)
+	{
+		return false;
+	}
+
+	// A file that was damaged or written by something else is regenerated rather than turned into a tree
+	uint64_t payloadHash = 0;
+	for (const TreeCacheSection& section : sections)
+	{
+		payloadHash = HashBytes(file.Data() + section.offset, size_t(section.bytes), payloadHash);
+	}
+	if (payloadHash != header.payloadHash)
+	{
+		return false;
+	}
+
+	s = 0;
+	ForEachCachedArray(tree, branchMeshes, crownLeavesMeshes, [&](auto& array)
+	{
+		using Element = typename std::decay_t<decltype(array)>::value_type;
+		static_assert(std::is_trivially_copyable<Element>::value, "cached arrays are copied as raw bytes");
+
+		const TreeCacheSection& section = sections[s++];
+		array.resize(size_t(section.bytes / sizeof(Element)));
+		if (section.bytes > 0)
+		{
+			std::memcpy(array.data(), file.Data() + section.offset, size_t(section.bytes));
+		}
+	});
+
+	// The file time is the last use, Trim removes the trees that have not been used the longest
+	file.Close();
+	std::error_code error;
+	std::filesystem::last_write_time(PathFor(key), std::filesystem::file_time_type::clock::now(), error);
+	return true;
+}
+
+bool TreeCache::Save(const TreeCacheKey& key, const TreeSkeleton& tree, const GLTriangleMesh& branchMeshes, const GLTriangleMesh& crownLeavesMeshes) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(folder, error);
+
+	std::vector<TreeCacheSection> sections;
+	uint64_t payloadHash = 0;
+	ForEachCachedArray(tree, branchMeshes, crownLeavesMeshes, [&](const auto& array)
+	{
+		using Element = typename std::decay_t<decltype(array)>::value_type;
+		sections.push_back(TreeCacheSection{ 0, uint64_t(array.size() * sizeof(Element)) });
+		payloadHash = HashBytes(array.data(), array.size() * sizeof(Element), payloadHash);
+	});
+
+	uint64_t offset = AlignCacheOffset(sizeof(TreeCacheHeader) + sections.size() * sizeof(TreeCacheSection));
+	for (TreeCacheSection& section : sections)
+	{
+		section.offset = offset;
+		offset = AlignCacheOffset(offset + section.bytes);
+	}
+
+	TreeCacheHeader header;
+	std::memcpy(header.magic, TreeCacheMagic, sizeof(TreeCacheMagic));
+	header.formatVersion = TreeCacheFormatVersion;
+	header.sectionCount = uint32_t(sections.size());
+	header.key = key;
+	header.payloadHash = payloadHash;
+
+	// Written next to the final file and renamed when complete, so a reader never maps a half written tree
+	std::filesystem::path path = PathFor(key);
+	std::filesystem::path temporaryPath = path;
+	temporaryPath += ".tmp";
+	{
+		std::ofstream output(temporaryPath, std::ios::binary | std::ios::trunc);
+		if (!output)
+		{
+			return false;
+		}
+
+		output.write((const char*)&header, sizeof(header));
+		output.write((const char*)sections.data(), sections.size() * sizeof(TreeCacheSection));
+
+		const char padding[TreeCacheAlignment] = {};
+		uint64_t written = sizeof(header) + sections.size() * sizeof(TreeCacheSection);
+		size_t s = 0;
+		ForEachCachedArray(tree, branchMeshes, crownLeavesMeshes, [&](const auto& array)
+		{
+			const TreeCacheSection& section = sections[s++];
+			output.write(padding, std::streamsize(section.offset - written));
+			output.write((const char*)array.data(), std::streamsize(section.bytes));
+			written = section.offset + section.bytes;
+		});
+
+		if (!output)
+		{
+			output.close();
+			std::filesystem::remove(temporaryPath, error);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(temporaryPath, path, error);
+	if (error)
+	{
+		std::filesystem::remove(temporaryPath, error);
+		return false;
+	}
+
+	Trim();
+	return true;
+}
+
+void TreeCache::Trim() const
+{
+	struct CachedFile
+	{
+		std::filesystem::path path;
+		std::filesystem::file_time_type lastUse;
+		uint64_t bytes;
+	};
+
+	std::error_code error;
+	std::vector<CachedFile> files;
+	uint64_t totalBytes = 0;
+	for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(folder, error))
+	{
+		if (entry.path().extension() != ".tree")
+		{
+			continue;
+		}
+
+		std::error_code timeError, sizeError;
+		CachedFile file{ entry.path(), entry.last_write_time(timeError), entry.file_size(sizeError) };
+		if (!timeError && !sizeError)
+		{
+			files.push_back(file);
+			totalBytes += file.bytes;
+		}
+	}
+
+	if (totalBytes <= maxBytes)
+	{
+		return;
+	}
+
+	// Least recently used first, the newest file always stays even when it is larger than maxBytes on its own
+	std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) { return a.lastUse < b.lastUse; });
+	for (size_t i = 0; i + 1 < files.size() && totalBytes > maxBytes; i++)
+	{
+		if (std::filesystem::remove(files[i].path, error))
+		{
+			totalBytes -= files[i].bytes;
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include "tree.h"
+#include <filesystem>
+
+// Everything a generated tree depends on. The fields are laid out without padding, so the key can be hashed
+// and stored as raw bytes.
+struct TreeCacheKey
+{
+	uint32_t generatorVersion = TreeGeneratorVersion;
+	int32_t iterations = 0;
+	int32_t subdivisions = 0;
+	uint32_t padding = 0;		// always 0, spelled out so the compiler adds none
+	uint64_t seed = 0;
+	uint64_t descriptorHash = 0;	// SpeciesDescriptor::Hash, the descriptor also drives the meshing of species files
+	uint64_t speciesHash = 0;	// GrammarProgram::sourceHash, 0 for the built-in grammar
+	uint64_t leafMeshHash = 0;	// the leaf mesh is instanced into the crown, so it is part of the result
+
+	uint64_t Hash() const;
+
+	bool operator==(const TreeCacheKey& other) const;
+};
+
+TreeCacheKey MakeTreeCacheKey(const SpeciesDescriptor& descriptor, uint64_t seed, int treeIterations, int treeSubdivisions, const GrammarProgram* species, const GLTriangleMesh& leafMesh);
+
+// Content addressed store of generated trees, one file per key named after the key hash. A file holds the
+// skeleton, the branch table and the CPU side of the branch and leaf meshes as raw arrays. Loading maps the
+// file, checks the hash of the arrays and copies them straight into place, nothing is parsed.
+class TreeCache
+{
+public:
+	std::filesystem::path folder;
+	uint64_t maxBytes = 512ull << 20; // Save removes the least recently used trees once the folder grows past this
+
+	TreeCache() = default;
+	explicit TreeCache(std::filesystem::path cacheFolder);
+	~TreeCache() = default;
+
+	std::filesystem::path PathFor(const TreeCacheKey& key) const;
+
+	// Returns false when there is no file for the key or the file does not hold exactly this key
+	bool Load(const TreeCacheKey& key, TreeSkeleton& tree, GLTriangleMesh& branchMeshes, GLTriangleMesh& crownLeavesMeshes) const;
+	bool Save(const TreeCacheKey& key, const TreeSkeleton& tree, const GLTriangleMesh& branchMeshes, const GLTriangleMesh& crownLeavesMeshes) const;
+
+	// Deletes cache files, least recently loaded or saved first, until the folder holds at most maxBytes
+	void Trim() const;
+};